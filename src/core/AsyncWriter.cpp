@@ -0,0 +1,125 @@
+#include "AsyncWriter.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace sim
+{
+
+AsyncWriter::AsyncWriter()
+:pending(0)
+,max_pending(0)
+,stopping(false)
+{
+}
+
+/**
+ * Finishes any outstanding jobs, an exception thrown by one of them is lost.
+ */
+AsyncWriter::~AsyncWriter()
+{
+	if(!running()) return;
+
+	{
+		unique_lock<mutex> guard(lock);
+		stopping = true;
+	}
+	changed.notify_all();
+	thread.join();
+}
+
+/**
+ * Starts the writing thread, allowing max_pending jobs to be outstanding.
+ */
+void AsyncWriter::start(size_t max_pending_)
+{
+	max_pending = std::max<size_t>(max_pending_,1);
+	if(!running())
+		thread = std::thread(&AsyncWriter::loop,this);
+}
+
+bool AsyncWriter::running() const
+{
+	return thread.joinable();
+}
+
+size_t AsyncWriter::maxPending() const
+{
+	return max_pending;
+}
+
+/**
+ * Blocks until fewer than maxPending() jobs are outstanding.
+ */
+void AsyncWriter::waitForSlot()
+{
+	unique_lock<mutex> guard(lock);
+	changed.wait(guard,[this](){ return pending<max_pending || error; });
+	rethrow();
+}
+
+/**
+ * Queues a job, waitForSlot() must have been called first.
+ */
+void AsyncWriter::submit(function<void()> job)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		jobs.push_back(std::move(job));
+		++pending;
+	}
+	changed.notify_all();
+}
+
+/**
+ * Blocks until every job has been run.
+ */
+void AsyncWriter::finish()
+{
+	unique_lock<mutex> guard(lock);
+	changed.wait(guard,[this](){ return pending==0; });
+	rethrow();
+}
+
+void AsyncWriter::loop()
+{
+	unique_lock<mutex> guard(lock);
+	for(;;)
+	{
+		changed.wait(guard,[this](){ return !jobs.empty() || stopping; });
+		if(jobs.empty()) return; // stopping
+
+		function<void()> job = std::move(jobs.front());
+		jobs.pop_front();
+
+		guard.unlock();
+		try
+		{
+			job();
+		}
+		catch(...)
+		{
+			guard.lock();
+			error = current_exception();
+			guard.unlock();
+		}
+		guard.lock();
+
+		--pending;
+		changed.notify_all();
+	}
+}
+
+// called with the lock held
+void AsyncWriter::rethrow()
+{
+	if(error)
+	{
+		exception_ptr e = error;
+		error = nullptr;
+		rethrow_exception(e);
+	}
+}
+
+} /* namespace sim */
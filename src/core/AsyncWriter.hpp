@@ -0,0 +1,55 @@
+#ifndef ASYNCWRITER_HPP_
+#define ASYNCWRITER_HPP_
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+
+namespace sim
+{
+
+/*
+ * Runs output jobs on a dedicated thread so that the time stepping carries on
+ * while a snapshot is written. The jobs are run in the order they are
+ * submitted. At most maxPending() jobs may be queued or running at once,
+ * waitForSlot() blocks until there is room so a writer which falls behind
+ * holds up the simulation rather than queueing snapshots without limit.
+ *
+ * The jobs must not make MPI calls, MPI is only initialised for use by the
+ * main thread. If a job throws the exception is rethrown from the next call
+ * to waitForSlot() or finish().
+ */
+class AsyncWriter
+{
+public:
+	AsyncWriter();
+	~AsyncWriter();
+
+	void start(size_t max_pending);
+	bool running() const;
+	size_t maxPending() const;
+
+	void waitForSlot();
+	void submit(std::function<void()> job);
+	void finish();
+
+private:
+	void loop();
+	void rethrow();
+
+	std::thread							thread;
+	std::mutex							lock;
+	std::condition_variable				changed;
+	std::deque<std::function<void()>>	jobs;
+	size_t								pending;	 // jobs queued or running
+	size_t								max_pending;
+	bool								stopping;
+	std::exception_ptr					error;		 // thrown by a job
+};
+
+} /* namespace sim */
+
+#endif /* ASYNCWRITER_HPP_ */
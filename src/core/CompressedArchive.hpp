@@ -0,0 +1,323 @@
+#ifndef COMPRESSEDARCHIVE_HPP_
+#define COMPRESSEDARCHIVE_HPP_
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <fstream>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+#include "ParticleStore.hpp"
+
+namespace sim
+{
+
+/*
+ * Compression of the per process boost archives, the archive is written
+ * through a streaming compressor so the uncompressed file is never held in
+ * memory or written to disk.
+ */
+enum Compression { NoCompression, Gzip, Zstd };
+
+// the suffix added to the names of compressed files
+inline const char* compression_suffix(Compression compression)
+{
+	switch(compression)
+	{
+	case Gzip: return ".gz";
+	case Zstd: return ".zst";
+	default:   return "";
+	}
+}
+
+/**
+ * Writes obj to a binary archive in the file fname, through the compressor
+ * at the given level (a negative level uses the compressor's default).
+ * Returns false if the file can't be opened.
+ */
+template<class T>
+bool write_archive(const std::string& fname, const T& obj, Compression compression, int level)
+{
+	namespace io = boost::iostreams;
+
+	std::ofstream fout(fname,std::ios::binary);
+	if(!fout.is_open())
+		return false;
+
+	io::filtering_ostream out;
+	if(compression==Gzip)
+		out.push(io::gzip_compressor(io::gzip_params(level<0 ? io::gzip::default_compression : level)));
+	else if(compression==Zstd)
+		out.push(io::zstd_compressor(io::zstd_params(level<0 ? io::zstd::default_compression : level)));
+	out.push(fout);
+
+	{
+		boost::archive::binary_oarchive oarch(out);
+		oarch << obj;
+	} // the archive writes its last bytes when destroyed
+
+	out.reset(); // flush and finish the compressed stream
+	return true;
+}
+
+/*
+ * A column of doubles stored to within an absolute error bound. The values
+ * are stored as unsigned offsets from the smallest value in steps of twice the
+ * bound, in 16 bits if the range allows and otherwise 32, so no value is more
+ * than the bound away from what is stored. Columns whose range needs more than
+ * 32 bits, which hold non-finite values or which have no bound are stored
+ * unchanged as doubles.
+ */
+class QuantisedColumn
+{
+public:
+	QuantisedColumn() : offset(0.0), step(0.0), bits(64) {}
+
+	void assign(const std::vector<double>& x, double bound)
+	{
+		q16.clear();
+		q32.clear();
+		raw.clear();
+
+		offset = 0.0;
+		step = 2.0*bound;
+		bits = 64;
+
+		double lo = std::numeric_limits<double>::max(), hi = -lo;
+		bool finite = true;
+		for(double v : x)
+		{
+			finite = finite && std::isfinite(v);
+			lo = std::min(lo,v);
+			hi = std::max(hi,v);
+		}
+
+		double range = x.empty() ? 0.0 : (hi-lo)/step;
+		if(bound>0.0 && finite && range<std::numeric_limits<uint32_t>::max())
+		{
+			offset = x.empty() ? 0.0 : lo;
+			bits = range<std::numeric_limits<uint16_t>::max() ? 16 : 32;
+		}
+
+		if(bits==16)
+			for(double v : x)
+				q16.push_back((uint16_t)std::llround((v-offset)/step));
+		else if(bits==32)
+			for(double v : x)
+				q32.push_back((uint32_t)std::llround((v-offset)/step));
+		else
+			raw = x;
+	}
+
+	// the stored values
+	std::vector<double> values() const
+	{
+		if(bits==64) return raw;
+
+		std::vector<double> x;
+		if(bits==16)
+			for(uint16_t q : q16)
+				x.push_back(offset+q*step);
+		else
+			for(uint32_t q : q32)
+				x.push_back(offset+q*step);
+		return x;
+	}
+
+	template<class Archive> void serialize(Archive& a, const unsigned int version)
+	{
+		a & bits;
+		a & offset;
+		a & step;
+		a & q16;
+		a & q32;
+		a & raw;
+	}
+
+private:
+	double					offset;
+	double					step;
+	uint32_t				bits;  // 16, 32 or 64 for unquantised doubles
+	std::vector<uint16_t>	q16;
+	std::vector<uint32_t>	q32;
+	std::vector<double>		raw;
+};
+
+/*
+ * Absolute error bounds for the quantised fields, zero keeps a field exact.
+ */
+struct QuantisationBounds
+{
+	QuantisationBounds() : position(0.0), velocity(0.0), density(0.0), pressure(0.0) {}
+
+	double position;
+	double velocity;
+	double density;
+	double pressure;
+};
+
+/*
+ * The particle fields written to a compact snapshot and the time level the
+ * fields with one value per level are taken from.
+ */
+struct OutputFields
+{
+	enum Field
+	{
+		Fluid = 1<<0, Wall = 1<<1, Id = 1<<2, Type = 1<<3,
+		Pos = 1<<4, Vel = 1<<5, Acc = 1<<6, Sigma = 1<<7,
+		Density = 1<<8, Pressure = 1<<9, GradC = 1<<10
+	};
+
+	// everything a snapshot needs to be looked at
+	OutputFields() : mask(Fluid|Wall|Id|Type|Pos|Vel|Density|Pressure), time_level(0) {}
+
+	bool has(Field field) const { return (mask & field)!=0; }
+
+	/**
+	 * Selects the fields named in a whitespace separated list, e.g.
+	 * "id pos pressure", using the names of the members of Particle.
+	 */
+	void select(const std::string& names)
+	{
+		static const char* field_names[11] = { "fluid", "wall", "id", "type", "pos", "vel", "acc", "sigma", "density", "pressure", "gradC" };
+
+		mask = 0;
+		std::istringstream in(names);
+		std::string name;
+		while(in >> name)
+		{
+			size_t f = std::find(field_names,field_names+11,name)-field_names;
+			if(f==11)
+				throw std::runtime_error("Unknown output field "+name+"!");
+			mask |= 1u<<f;
+		}
+	}
+
+	template<class Archive> void serialize(Archive& a, const unsigned int version)
+	{
+		a & mask;
+		a & time_level;
+	}
+
+	uint32_t	mask;
+	uint32_t	time_level;
+};
+
+/*
+ * The owned particles as written to a compact snapshot, holding only the
+ * selected fields at one time level with each vector component in its own
+ * column. The selection is written first so the snapshot can be read back
+ * without knowing it.
+ */
+template<size_t Dim, size_t NCol>
+class CompactParticles
+{
+public:
+	template<size_t TStep>
+	void assign(const ParticleStore<Dim,TStep,NCol>& store, size_t n, const OutputFields& select, const QuantisationBounds& bounds)
+	{
+		fields = select;
+		size_t t = fields.time_level;
+
+		if(fields.has(OutputFields::Fluid)) fluid.assign(store.fluid.begin(),store.fluid.begin()+n);
+		if(fields.has(OutputFields::Wall))	wall.assign(store.wall.begin(),store.wall.begin()+n);
+		if(fields.has(OutputFields::Id))	id.assign(store.id.begin(),store.id.begin()+n);
+		if(fields.has(OutputFields::Type))	type.assign(store.type.begin(),store.type.begin()+n);
+
+		std::vector<double> x(n);
+		for(size_t d=0;d<Dim;++d)
+		{
+			if(fields.has(OutputFields::Pos))
+			{
+				for(size_t i=0;i<n;++i)
+					x[i] = discard_dims(store.pos[t][i][d]);
+				pos[d].assign(x,bounds.position);
+			}
+
+			if(fields.has(OutputFields::Vel))
+			{
+				for(size_t i=0;i<n;++i)
+					x[i] = discard_dims(store.vel[t][i][d]);
+				vel[d].assign(x,bounds.velocity);
+			}
+
+			if(fields.has(OutputFields::Acc))
+			{
+				for(size_t i=0;i<n;++i)
+					x[i] = discard_dims(store.acc[i][d]);
+				acc[d].assign(x,0.0);
+			}
+
+			if(fields.has(OutputFields::GradC))
+				for(size_t c=0;c<NCol;++c)
+				{
+					for(size_t i=0;i<n;++i)
+						x[i] = discard_dims(store.gradC[c][i][d]);
+					gradC[c][d].assign(x,0.0);
+				}
+		}
+
+		if(fields.has(OutputFields::Sigma))
+		{
+			for(size_t i=0;i<n;++i)
+				x[i] = discard_dims(store.sigma[i]);
+			sigma.assign(x,0.0);
+		}
+
+		if(fields.has(OutputFields::Density))
+		{
+			for(size_t i=0;i<n;++i)
+				x[i] = discard_dims(store.density[t][i]);
+			density.assign(x,bounds.density);
+		}
+
+		if(fields.has(OutputFields::Pressure))
+		{
+			for(size_t i=0;i<n;++i)
+				x[i] = discard_dims(store.pressure[i]);
+			pressure.assign(x,bounds.pressure);
+		}
+	}
+
+	template<class Archive> void serialize(Archive& a, const unsigned int version)
+	{
+		a & fields;
+		if(fields.has(OutputFields::Fluid))	   a & fluid;
+		if(fields.has(OutputFields::Wall))	   a & wall;
+		if(fields.has(OutputFields::Id))	   a & id;
+		if(fields.has(OutputFields::Type))	   a & type;
+		if(fields.has(OutputFields::Pos))	   a & pos;
+		if(fields.has(OutputFields::Vel))	   a & vel;
+		if(fields.has(OutputFields::Acc))	   a & acc;
+		if(fields.has(OutputFields::Sigma))	   a & sigma;
+		if(fields.has(OutputFields::Density))  a & density;
+		if(fields.has(OutputFields::Pressure)) a & pressure;
+		if(fields.has(OutputFields::GradC))	   a & gradC;
+	}
+
+	OutputFields			fields;
+	std::vector<size_t>		fluid;
+	std::vector<size_t>		wall;
+	std::vector<size_t>		id;
+	std::vector<uint8_t>	type; // a ParticleType
+	QuantisedColumn			pos[Dim];
+	QuantisedColumn			vel[Dim];
+	QuantisedColumn			acc[Dim];
+	QuantisedColumn			sigma;
+	QuantisedColumn			density;
+	QuantisedColumn			pressure;
+	QuantisedColumn			gradC[NCol][Dim];
+};
+
+} /* namespace sim */
+
+#endif /* COMPRESSEDARCHIVE_HPP_ */
@@ -0,0 +1,301 @@
+#ifndef HDF5FILE_HPP_
+#define HDF5FILE_HPP_
+
+#ifdef SPH_HDF5
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <mpi.h>
+#include <hdf5.h>
+#include <boost/mpi/exception.hpp>
+#include "ParticleStore.hpp"
+#include "CompressedArchive.hpp"
+
+namespace sim
+{
+
+/*
+ * Snapshots written as HDF5 files holding one dataset per field, rather than
+ * whole particles, so a reader only needs to read the fields it uses. The
+ * datasets are
+ *
+ *	/pos		N x Dim doubles
+ *	/vel		N x Dim doubles
+ *	/density	N doubles
+ *	/pressure	N doubles
+ *	/id			N unsigned 64 bit integers
+ *	/fluid		N unsigned 64 bit integers
+ *
+ * with an XDMF file, root.N.xmf, alongside describing them so the snapshot can
+ * be opened in ParaView. Only the datasets selected by OutputFields are
+ * written, from its time level, apart from pos which the XDMF file needs.
+ *
+ * If HDF5 was built with MPI support every process writes its rows of the
+ * datasets in a single file, root.N.h5, as with write_snapshot(). Otherwise
+ * each process writes its own file, root.N.rank.h5, and the XDMF file joins
+ * them into one collection.
+ */
+struct HDF5Options
+{
+	HDF5Options() : chunk(0), compression(0) {}
+
+	size_t	chunk;		  // particles per chunk, 0 for contiguous datasets
+	int		compression;  // gzip level from 1 to 9, 0 for none, needs chunking
+};
+
+namespace hdf5_detail
+{
+
+inline void check(long long result, const std::string& what)
+{
+	if(result<0)
+		throw std::runtime_error("HDF5 error writing "+what+"!");
+}
+
+// an HDF5 identifier closed when it goes out of scope, so one thrown past by
+// check() isn't leaked
+class Handle
+{
+public:
+	Handle(hid_t id, herr_t (*closer)(hid_t)) : id(id), closer(closer) {}
+	~Handle() { close(); }
+
+	operator hid_t() const { return id; }
+
+	herr_t close()
+	{
+		herr_t result = id<0 ? 0 : closer(id);
+		id = -1;
+		return result;
+	}
+
+private:
+	Handle(const Handle&);
+	Handle& operator=(const Handle&);
+
+	hid_t	id;
+	herr_t	(*closer)(hid_t);
+};
+
+// writes rows [first,first+count) of a dataset of total rows
+template<class T>
+void write_column(hid_t file, const char* name, hid_t type, const std::vector<T>& column, size_t components, uint64_t first, uint64_t count, uint64_t total, const HDF5Options& opts)
+{
+	int rank = components>1 ? 2 : 1;
+
+	hsize_t dims[2] = {total,components};
+	Handle space(H5Screate_simple(rank,dims,nullptr),H5Sclose);
+	check(space,name);
+
+	Handle dcpl(H5Pcreate(H5P_DATASET_CREATE),H5Pclose);
+	check(dcpl,name);
+	if(opts.chunk && total)
+	{
+		hsize_t chunk[2] = {std::min<hsize_t>(opts.chunk,total),components};
+		check(H5Pset_chunk(dcpl,rank,chunk),name);
+		if(opts.compression)
+			check(H5Pset_deflate(dcpl,opts.compression),name);
+	}
+
+	Handle dset(H5Dcreate2(file,name,type,space,H5P_DEFAULT,dcpl,H5P_DEFAULT),H5Dclose);
+	check(dset,name);
+
+	// a process with no rows still joins the collective write, selecting
+	// nothing from a single row rather than a zero sized block
+	hsize_t start[2] = {first,0};
+	hsize_t rows[2] = {std::max<hsize_t>(count,1),components};
+	Handle memspace(H5Screate_simple(rank,rows,nullptr),H5Sclose);
+	check(memspace,name);
+
+	if(count)
+	{
+		check(H5Sselect_hyperslab(space,H5S_SELECT_SET,start,nullptr,rows,nullptr),name);
+	}
+	else
+	{
+		check(H5Sselect_none(space),name);
+		check(H5Sselect_none(memspace),name);
+	}
+
+	Handle dxpl(H5Pcreate(H5P_DATASET_XFER),H5Pclose);
+	check(dxpl,name);
+#ifdef H5_HAVE_PARALLEL
+	check(H5Pset_dxpl_mpio(dxpl,H5FD_MPIO_COLLECTIVE),name);
+#endif
+
+	T none = T();
+	check(H5Dwrite(dset,type,memspace,space,dxpl,count ? column.data() : &none),name);
+}
+
+inline std::string data_item(const std::string& file, const char* name, uint64_t n, size_t components, const char* type)
+{
+	std::stringstream s;
+	s << "<DataItem Dimensions=\"" << n;
+	if(components>1) s << ' ' << components;
+	s << "\" NumberType=\"" << type << "\" Precision=\"8\" Format=\"HDF\">" << file << ":/" << name << "</DataItem>";
+	return s.str();
+}
+
+// one grid of points for each data file, which are next to the XDMF file
+inline void write_xdmf(const std::string& fname, size_t dim, const OutputFields& fields, const std::vector<std::string>& files, const std::vector<uint64_t>& counts)
+{
+	std::ofstream out(fname);
+	if(!out.is_open())
+	{
+		std::cerr << "Error opening output file " << fname << std::endl;
+		return;
+	}
+
+	out << "<?xml version=\"1.0\" ?>\n"
+		<< "<!DOCTYPE Xdmf SYSTEM \"Xdmf.dtd\" []>\n"
+		<< "<Xdmf Version=\"2.0\">\n"
+		<< " <Domain>\n"
+		<< "  <Grid Name=\"particles\" GridType=\"Collection\" CollectionType=\"Spatial\">\n";
+
+	const char* scalars[4][2] = { {"density","Float"}, {"pressure","Float"}, {"id","UInt"}, {"fluid","UInt"} };
+	const OutputFields::Field scalar_fields[4] = { OutputFields::Density, OutputFields::Pressure, OutputFields::Id, OutputFields::Fluid };
+
+	for(size_t f=0;f<files.size();++f)
+	{
+		std::string file = files[f].substr(files[f].find_last_of('/')+1);
+		uint64_t n = counts[f];
+
+		out << "   <Grid Name=\"part" << f << "\" GridType=\"Uniform\">\n"
+			<< "    <Topology TopologyType=\"Polyvertex\" NumberOfElements=\"" << n << "\"/>\n"
+			<< "    <Geometry GeometryType=\"" << (dim==2 ? "XY" : "XYZ") << "\">\n"
+			<< "     " << data_item(file,"pos",n,dim,"Float") << "\n"
+			<< "    </Geometry>\n";
+
+		if(fields.has(OutputFields::Vel))
+			out << "    <Attribute Name=\"vel\" AttributeType=\"Vector\" Center=\"Node\">\n"
+				<< "     " << data_item(file,"vel",n,dim,"Float") << "\n"
+				<< "    </Attribute>\n";
+
+		for(size_t s=0;s<4;++s)
+			if(fields.has(scalar_fields[s]))
+				out << "    <Attribute Name=\"" << scalars[s][0] << "\" AttributeType=\"Scalar\" Center=\"Node\">\n"
+					<< "     " << data_item(file,scalars[s][0],n,1,scalars[s][1]) << "\n"
+					<< "    </Attribute>\n";
+
+		out << "   </Grid>\n";
+	}
+
+	out << "  </Grid>\n"
+		<< " </Domain>\n"
+		<< "</Xdmf>\n";
+}
+
+} /* namespace hdf5_detail */
+
+/**
+ * Writes the selected fields of the first n particles of the store from each
+ * process into the snapshot fname_root.h5 (or fname_root.rank.h5) and fname_root.xmf. This must
+ * be called by every process at the same time.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+void write_hdf5(MPI_Comm comm, const std::string& fname_root, const ParticleStore<Dim,TStep,NCol>& particles, size_t n, const OutputFields& fields, const HDF5Options& opts)
+{
+	using namespace hdf5_detail;
+
+	int rank, size;
+	BOOST_MPI_CHECK_RESULT(MPI_Comm_rank,(comm,&rank));
+	BOOST_MPI_CHECK_RESULT(MPI_Comm_size,(comm,&size));
+
+	uint64_t count = n, first = 0, total;
+	std::vector<std::string> files;
+	std::vector<uint64_t> counts;
+
+#ifdef H5_HAVE_PARALLEL
+	// where our rows start
+	BOOST_MPI_CHECK_RESULT(MPI_Exscan,(&count,&first,1,MPI_UINT64_T,MPI_SUM,comm));
+	BOOST_MPI_CHECK_RESULT(MPI_Allreduce,(&count,&total,1,MPI_UINT64_T,MPI_SUM,comm));
+	if(rank==0) first = 0; // left undefined by MPI_Exscan
+
+	files.push_back(fname_root+".h5");
+	counts.push_back(total);
+
+	Handle fapl(H5Pcreate(H5P_FILE_ACCESS),H5Pclose);
+	check(fapl,files[0]);
+	check(H5Pset_fapl_mpio(fapl,comm,MPI_INFO_NULL),files[0]);
+	Handle file(H5Fcreate(files[0].c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,fapl),H5Fclose);
+	check(file,files[0]);
+	fapl.close();
+#else
+	total = count;
+
+	counts.resize(size);
+	BOOST_MPI_CHECK_RESULT(MPI_Gather,(&count,1,MPI_UINT64_T,counts.data(),1,MPI_UINT64_T,0,comm));
+	for(int r=0;r<size;++r)
+	{
+		std::stringstream sstr;
+		sstr << fname_root << '.' << r << ".h5";
+		files.push_back(sstr.str());
+	}
+
+	Handle file(H5Fcreate(files[rank].c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,H5P_DEFAULT),H5Fclose);
+	check(file,files[rank]);
+#endif
+
+	// copy out each field in turn
+	std::vector<double> vect(n*Dim), scalar(n);
+	std::vector<uint64_t> integer(n);
+	size_t t = fields.time_level;
+
+	for(size_t i=0;i<n;++i)
+		for(size_t d=0;d<Dim;++d)
+			vect[i*Dim+d] = discard_dims(particles.pos[t][i][d]);
+	write_column(file,"pos",H5T_NATIVE_DOUBLE,vect,Dim,first,count,total,opts);
+
+	if(fields.has(OutputFields::Vel))
+	{
+		for(size_t i=0;i<n;++i)
+			for(size_t d=0;d<Dim;++d)
+				vect[i*Dim+d] = discard_dims(particles.vel[t][i][d]);
+		write_column(file,"vel",H5T_NATIVE_DOUBLE,vect,Dim,first,count,total,opts);
+	}
+
+	if(fields.has(OutputFields::Density))
+	{
+		for(size_t i=0;i<n;++i)
+			scalar[i] = discard_dims(particles.density[t][i]);
+		write_column(file,"density",H5T_NATIVE_DOUBLE,scalar,1,first,count,total,opts);
+	}
+
+	if(fields.has(OutputFields::Pressure))
+	{
+		for(size_t i=0;i<n;++i)
+			scalar[i] = discard_dims(particles.pressure[i]);
+		write_column(file,"pressure",H5T_NATIVE_DOUBLE,scalar,1,first,count,total,opts);
+	}
+
+	if(fields.has(OutputFields::Id))
+	{
+		for(size_t i=0;i<n;++i)
+			integer[i] = particles.id[i];
+		write_column(file,"id",H5T_NATIVE_UINT64,integer,1,first,count,total,opts);
+	}
+
+	if(fields.has(OutputFields::Fluid))
+	{
+		for(size_t i=0;i<n;++i)
+			integer[i] = particles.fluid[i];
+		write_column(file,"fluid",H5T_NATIVE_UINT64,integer,1,first,count,total,opts);
+	}
+
+	check(file.close(),fname_root);
+
+	if(rank==0)
+		write_xdmf(fname_root+".xmf",Dim,fields,files,counts);
+}
+
+} /* namespace sim */
+
+#endif /* SPH_HDF5 */
+
+#endif /* HDF5FILE_HPP_ */
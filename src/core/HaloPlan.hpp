@@ -0,0 +1,243 @@
+#ifndef HALOPLAN_HPP_
+#define HALOPLAN_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <mpi.h>
+#include <boost/mpi/datatype.hpp>
+#include <boost/mpi/exception.hpp>
+
+namespace sim
+{
+
+/*
+ * The messages exchanged with each neighbouring process during a halo
+ * exchange. It is set up once per decomposition and keeps a send and receive
+ * buffer for every neighbour along with MPI persistent requests on them, so an
+ * exchange is just packing the send buffers, start() and wait().
+ *
+ * The receive buffers are given some headroom over the largest message seen so
+ * far. A message which fills the receive buffer completely means the sender
+ * had more to send: the rest follows on an overflow tag, after which both
+ * sides grow the buffer to the same new capacity. So there is only a second
+ * message when the counts overflow, not a count exchange before every one.
+ *
+ * T must be an mpi datatype, see boost::mpi::is_mpi_datatype.
+ */
+template<class T>
+class HaloPlan
+{
+public:
+	HaloPlan();
+	~HaloPlan();
+
+	void setup(MPI_Comm comm, const std::vector<int>& ranks, const std::vector<int>& send_tags, const std::vector<int>& recv_tags);
+
+	size_t neighbours() const;
+
+	T* sendBuffer(size_t i, size_t n);
+	void start();
+	void wait();
+	T* recvBuffer(size_t i);
+	size_t recvCount(size_t i) const;
+
+private:
+	HaloPlan(const HaloPlan&);				 // not copyable, the requests
+	HaloPlan& operator=(const HaloPlan&);	 // refer to the buffers
+
+	enum
+	{
+		overflow_tag = 1<<8,  // or'd with the tag of the link
+		initial_capacity = 64
+	};
+
+	static size_t grow(size_t n) { return n + n/4 + initial_capacity; }
+
+	void freeRequests();
+
+	MPI_Comm			comm;
+	MPI_Datatype		type;
+	std::vector<int>	ranks;
+	std::vector<int>	send_tags;
+	std::vector<int>	recv_tags;
+
+	std::vector<std::vector<T>>	send_bufs;
+	std::vector<size_t>			send_count;	   // particles packed in each send buffer
+	std::vector<size_t>			send_capacity; // the receiver's buffer size
+	std::vector<size_t>			send_posted;   // count the persistent send was set up with
+	std::vector<const T*>		send_posted_at;
+
+	std::vector<std::vector<T>>	recv_bufs;	   // sized to the capacity
+	std::vector<size_t>			recv_count;
+
+	std::vector<MPI_Request>	reqs;		   // sends then receives
+	std::vector<MPI_Request>	overflow_reqs;
+};
+
+template<class T>
+HaloPlan<T>::HaloPlan()
+:comm(MPI_COMM_NULL)
+,type(MPI_DATATYPE_NULL)
+{
+}
+
+template<class T>
+HaloPlan<T>::~HaloPlan()
+{
+	freeRequests();
+}
+
+/**
+ * Sets up the buffers and persistent requests for the given neighbours. Link i
+ * sends to ranks[i] with send_tags[i] and receives from it with recv_tags[i].
+ * Every process must call this at the same time since the initial capacities
+ * have to agree.
+ */
+template<class T>
+void HaloPlan<T>::setup(MPI_Comm comm_, const std::vector<int>& ranks_, const std::vector<int>& send_tags_, const std::vector<int>& recv_tags_)
+{
+	freeRequests();
+
+	comm = comm_;
+	type = boost::mpi::get_mpi_datatype<T>(T());
+	ranks = ranks_;
+	send_tags = send_tags_;
+	recv_tags = recv_tags_;
+
+	size_t n = ranks.size();
+	send_bufs.assign(n,std::vector<T>());
+	send_count.assign(n,0);
+	send_capacity.assign(n,initial_capacity);
+	send_posted.assign(n,0);
+	send_posted_at.assign(n,nullptr);
+	recv_bufs.assign(n,std::vector<T>(initial_capacity));
+	recv_count.assign(n,0);
+	reqs.assign(2*n,MPI_REQUEST_NULL);
+
+	for(size_t i=0;i<n;++i)
+		BOOST_MPI_CHECK_RESULT(MPI_Recv_init,(recv_bufs[i].data(),(int)initial_capacity,type,ranks[i],recv_tags[i],comm,&reqs[n+i]));
+}
+
+template<class T>
+size_t HaloPlan<T>::neighbours() const
+{
+	return ranks.size();
+}
+
+/**
+ * Returns the buffer to pack the n values being sent to neighbour i into.
+ */
+template<class T>
+T* HaloPlan<T>::sendBuffer(size_t i, size_t n)
+{
+	send_bufs[i].resize(n);
+	send_count[i] = n;
+	return send_bufs[i].data();
+}
+
+/**
+ * Starts sending the packed buffers and receiving into the receive buffers.
+ */
+template<class T>
+void HaloPlan<T>::start()
+{
+	size_t n = ranks.size();
+	overflow_reqs.clear();
+
+	for(size_t i=0;i<n;++i)
+	{
+		// the receiver can't tell a full buffer from an overflowing one, so
+		// anything which fills it overflows
+		size_t count = std::min(send_count[i],send_capacity[i]);
+
+		// persistent sends have a fixed count and buffer so they only need
+		// setting up again when these change, i.e. after exchangeFull()
+		if(count!=send_posted[i] || send_bufs[i].data()!=send_posted_at[i] || reqs[i]==MPI_REQUEST_NULL)
+		{
+			if(reqs[i]!=MPI_REQUEST_NULL)
+				BOOST_MPI_CHECK_RESULT(MPI_Request_free,(&reqs[i]));
+			BOOST_MPI_CHECK_RESULT(MPI_Send_init,(send_bufs[i].data(),(int)count,type,ranks[i],send_tags[i],comm,&reqs[i]));
+			send_posted[i] = count;
+			send_posted_at[i] = send_bufs[i].data();
+		}
+
+		if(send_count[i]>=send_capacity[i])
+		{
+			overflow_reqs.push_back(MPI_REQUEST_NULL);
+			BOOST_MPI_CHECK_RESULT(MPI_Isend,(send_bufs[i].data()+count,(int)(send_count[i]-count),type,ranks[i],send_tags[i]|overflow_tag,comm,&overflow_reqs.back()));
+			send_capacity[i] = grow(send_count[i]);
+		}
+	}
+
+	BOOST_MPI_CHECK_RESULT(MPI_Startall,((int)reqs.size(),reqs.data()));
+}
+
+/**
+ * Waits for the exchange started by start() to complete, receiving the rest of
+ * any message which overflowed.
+ */
+template<class T>
+void HaloPlan<T>::wait()
+{
+	size_t n = ranks.size();
+	std::vector<MPI_Status> status(2*n);
+	BOOST_MPI_CHECK_RESULT(MPI_Waitall,((int)reqs.size(),reqs.data(),status.data()));
+
+	for(size_t i=0;i<n;++i)
+	{
+		int count;
+		BOOST_MPI_CHECK_RESULT(MPI_Get_count,(&status[n+i],type,&count));
+		recv_count[i] = count;
+
+		if(recv_count[i]<recv_bufs[i].size())
+			continue;
+
+		// the buffer is full so the rest is on its way
+		MPI_Status ostatus;
+		int extra;
+		BOOST_MPI_CHECK_RESULT(MPI_Probe,(ranks[i],recv_tags[i]|overflow_tag,comm,&ostatus));
+		BOOST_MPI_CHECK_RESULT(MPI_Get_count,(&ostatus,type,&extra));
+
+		// grow to match the sender's new capacity
+		size_t capacity = grow(recv_count[i]+extra);
+		recv_bufs[i].resize(capacity);
+		BOOST_MPI_CHECK_RESULT(MPI_Recv,(recv_bufs[i].data()+recv_count[i],extra,type,ranks[i],recv_tags[i]|overflow_tag,comm,MPI_STATUS_IGNORE));
+		recv_count[i] += extra;
+
+		BOOST_MPI_CHECK_RESULT(MPI_Request_free,(&reqs[n+i]));
+		BOOST_MPI_CHECK_RESULT(MPI_Recv_init,(recv_bufs[i].data(),(int)capacity,type,ranks[i],recv_tags[i],comm,&reqs[n+i]));
+	}
+
+	if(!overflow_reqs.empty())
+		BOOST_MPI_CHECK_RESULT(MPI_Waitall,((int)overflow_reqs.size(),overflow_reqs.data(),MPI_STATUSES_IGNORE));
+}
+
+template<class T>
+T* HaloPlan<T>::recvBuffer(size_t i)
+{
+	return recv_bufs[i].data();
+}
+
+template<class T>
+size_t HaloPlan<T>::recvCount(size_t i) const
+{
+	return recv_count[i];
+}
+
+template<class T>
+void HaloPlan<T>::freeRequests()
+{
+	int finalized;
+	MPI_Finalized(&finalized);
+	if(finalized)
+		return;
+
+	for(MPI_Request& req : reqs)
+		if(req!=MPI_REQUEST_NULL)
+			MPI_Request_free(&req);
+	reqs.clear();
+}
+
+} /* namespace sim */
+
+#endif /* HALOPLAN_HPP_ */
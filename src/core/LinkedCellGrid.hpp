@@ -2,7 +2,8 @@
 #define LINKEDCELLGRID_HPP_
 
 #include <vector>
-#include <list>
+#include <limits>
+#include <algorithm>
 #include <stdexcept>
 #include "Particle.hpp"
 #include "Region.hpp"
@@ -26,12 +27,26 @@ enum PaddingLocation
 // forward declaration
 template<size_t _Dim, class _T, int _Padding, size_t Loc> struct _lcg_impl;
 
+/*
+ * A linked cell grid over the particles held in a ParticleStore (T). Rather
+ * than intrusive lists the cells are singly linked lists of particle indices;
+ * each cell stores the indices of its first and last particles and each
+ * particle the index of the next particle in the same cell. Particles are
+ * appended so a cell lists them in the order they were placed.
+ *
+ * In sorted mode the linked lists are replaced by a cell-start/cell-count
+ * offset table into an array of particle indices grouped by cell, built by a
+ * counting sort. Combined with sort(), which physically reorders the store by
+ * cell, the particles of a cell are then contiguous in memory.
+ */
 template< size_t Dim, typename T, size_t Padding=1>
 class LinkedCellGrid
 {
 public:
 
-	LinkedCellGrid(){};
+	static const size_t npos = std::numeric_limits<size_t>::max(); // end of a cell
+
+	LinkedCellGrid():sorted_mode(false),table_dirty(false),placed(0){};
 	virtual ~LinkedCellGrid(){};
 
 	void init(qvect<Dim,length> cell_size, Extent<Dim> cell_counts, qvect<Dim,length> lower);
@@ -39,30 +54,59 @@ public:
 	Subscript<Dim> idxToSub(size_t idx);
 	size_t subToIdx(const Subscript<Dim>& sub);
 	Subscript<Dim> posToSub(const nvect<Dim,quantity<position>>&);
-	LCGList<T>& getCell(size_t idx);
+	size_t cellHead(size_t idx) const;
+	size_t nextInCell(size_t part) const;
 	Extent<Dim> cellCount() const;
 
-	template<class BoostIntrusiveList>
-	void place(BoostIntrusiveList& list, size_t tstep);
-	void place(T& particle, size_t tstep);
+	// sorted mode
+	void setSorted(bool sorted);
+	bool sorted() const;
+	void buildTable();
+	size_t cellStart(size_t idx) const;
+	size_t cellSize(size_t idx) const;
+	const std::vector<size_t>& cellOrder() const;
+	size_t slotOf(size_t part) const;
+	void sort(T& store, size_t tstep, size_t first, size_t last);
+
+	template<class F> void forEachInCell(size_t idx, F&& f) const;
+
+	size_t place(T& store, size_t tstep, size_t first, size_t last);
+	template<class Scheduler> size_t place(T& store, size_t tstep, size_t first, size_t last, Scheduler& sched);
+	bool place(T& store, size_t tstep, size_t part);
 
 	void clear();
 
 	// functions which are forwarded
-	template<size_t Loc> fast_list<std::pair<T,T*>> getBorder();
+	template<size_t Loc> void getBorder(std::vector<size_t>& out);
 	template<size_t Loc> void clearPadding();
 
 private:
 	template<size_t _Dim, class _T, int _Padding, size_t Loc> friend struct _lcg_impl;
-	void appendCellContents(fast_list<std::pair<T,T*>>& out, const Subscript<Dim>& cell_sub);
+	void appendCellContents(std::vector<size_t>& out, const Subscript<Dim>& cell_sub);
+	void link(size_t part);
 
 	qvect<Dim,length>		lower;		 // lower-left corner of the grid
 	qvect<Dim,length>		cell_sizes;	 // physical sizes of the cells
 	Extent<Dim>				cell_counts; // including padding
 	nvect<Dim,int>			cell_counts_unpadded;
-	std::vector<LCGList<T>> cells;
+	std::vector<size_t>		heads;		 // first particle in each cell
+	std::vector<size_t>		tails;		 // last particle in each cell
+	std::vector<size_t>		next;		 // next particle in the same cell
+
+	// sorted mode
+	bool					sorted_mode;
+	bool					table_dirty; // particles have been placed since the table was built
+	size_t					placed;		 // the table covers particles [0,placed)
+	std::vector<size_t>		part_cell;	 // cell each particle was placed in
+	std::vector<size_t>		cell_start;	 // offset of each cell's first entry in order
+	std::vector<size_t>		cell_count;	 // number of particles in each cell, kept up to date in both modes
+	std::vector<size_t>		order;		 // particle indices grouped by cell
+	std::vector<size_t>		slot;		 // position of each particle within order
 };
 
+template<size_t Dim, typename T, size_t Padding>
+const size_t LinkedCellGrid<Dim,T,Padding>::npos;
+
 template<size_t Dim, typename T, size_t Padding>
 void LinkedCellGrid<Dim,T,Padding>::init(qvect<Dim,length> cell_sizes, Extent<Dim> cell_counts, qvect<Dim,length> lower)
 {
@@ -80,7 +124,12 @@ void LinkedCellGrid<Dim,T,Padding>::init(qvect<Dim,length> cell_sizes, Extent<Di
 	}
 
 	// create empty cells
-	cells.resize(ncells);
+	heads.assign(ncells,npos);
+	tails.assign(ncells,npos);
+	cell_start.assign(ncells,0);
+	cell_count.assign(ncells,0);
+	placed = 0;
+	table_dirty = true;
 }
 
 /**
@@ -116,12 +165,23 @@ Subscript<Dim> LinkedCellGrid<Dim,T,Padding>::posToSub(const nvect<Dim,quantity<
 }
 
 /**
- * Returns the list of particle pointers which corresponds to the given index.
+ * Returns the index of the first particle in the cell with the given index, or
+ * npos if the cell is empty.
  */
 template<size_t Dim, typename T, size_t Padding>
-LCGList<T>& LinkedCellGrid<Dim,T,Padding>::getCell(size_t idx)
+size_t LinkedCellGrid<Dim,T,Padding>::cellHead(size_t idx) const
 {
-	return cells[idx];
+	return heads[idx];
+}
+
+/**
+ * Returns the index of the particle following the given one in its cell, or
+ * npos if it is the last.
+ */
+template<size_t Dim, typename T, size_t Padding>
+size_t LinkedCellGrid<Dim,T,Padding>::nextInCell(size_t part) const
+{
+	return next[part];
 }
 
 /**
@@ -134,34 +194,254 @@ Extent<Dim> LinkedCellGrid<Dim,T,Padding>::cellCount() const
 }
 
 /**
- * Put a list of particles into the correct cells
+ * Switches between the linked lists (the default) and the sorted cell offset
+ * table. Takes effect from the next call to place().
+ */
+template<size_t Dim, typename T, size_t Padding>
+void LinkedCellGrid<Dim,T,Padding>::setSorted(bool sorted)
+{
+	sorted_mode = sorted;
+	table_dirty = true;
+}
+
+template<size_t Dim, typename T, size_t Padding>
+bool LinkedCellGrid<Dim,T,Padding>::sorted() const
+{
+	return sorted_mode;
+}
+
+/**
+ * Builds the cell offset table from the cells the particles were placed in,
+ * using a counting sort. Does nothing if no particles have been placed since
+ * the table was last built.
+ */
+template<size_t Dim, typename T, size_t Padding>
+void LinkedCellGrid<Dim,T,Padding>::buildTable()
+{
+	if(!table_dirty) return;
+
+	// count the particles in each cell
+	std::fill(cell_count.begin(),cell_count.end(),0);
+	for(size_t i=0;i<placed;++i)
+		++cell_count[part_cell[i]];
+
+	// cell offsets are the exclusive prefix sum of the counts
+	size_t offset = 0;
+	for(size_t c=0;c<cell_count.size();++c)
+	{
+		cell_start[c] = offset;
+		offset += cell_count[c];
+		cell_count[c] = 0; // recounted as we scatter
+	}
+
+	// scatter the particle indices, this keeps them in ascending order within a cell
+	order.resize(placed);
+	slot.resize(placed);
+	for(size_t i=0;i<placed;++i)
+	{
+		size_t c = part_cell[i];
+		size_t k = cell_start[c] + cell_count[c]++;
+		order[k] = i;
+		slot[i] = k;
+	}
+
+	table_dirty = false;
+}
+
+/**
+ * Returns the offset into cellOrder() of the first particle in the cell with
+ * the given index. Sorted mode only, the table must have been built.
+ */
+template<size_t Dim, typename T, size_t Padding>
+size_t LinkedCellGrid<Dim,T,Padding>::cellStart(size_t idx) const
+{
+	return cell_start[idx];
+}
+
+/**
+ * Returns the number of particles in the cell with the given index. In sorted
+ * mode the table must have been built.
+ */
+template<size_t Dim, typename T, size_t Padding>
+size_t LinkedCellGrid<Dim,T,Padding>::cellSize(size_t idx) const
+{
+	return cell_count[idx];
+}
+
+/**
+ * Returns the particle indices grouped by cell. Sorted mode only, the table
+ * must have been built.
+ */
+template<size_t Dim, typename T, size_t Padding>
+const std::vector<size_t>& LinkedCellGrid<Dim,T,Padding>::cellOrder() const
+{
+	return order;
+}
+
+/**
+ * Returns the position of a particle within cellOrder(). Sorted mode only, the
+ * table must have been built.
+ */
+template<size_t Dim, typename T, size_t Padding>
+size_t LinkedCellGrid<Dim,T,Padding>::slotOf(size_t part) const
+{
+	return slot[part];
+}
+
+/**
+ * Physically reorders the particles [first,last) of the store so that they are
+ * grouped by cell, in order of cell index. Note this invalidates any particle
+ * indices held elsewhere, the particles must be placed again afterwards.
  */
 template<size_t Dim, typename T, size_t Padding>
-template<class BoostIntrusiveList>
-void LinkedCellGrid<Dim,T,Padding>::place(BoostIntrusiveList& list, size_t tstep)
+void LinkedCellGrid<Dim,T,Padding>::sort(T& store, size_t tstep, size_t first, size_t last)
 {
-	for(T& particle : list)	place(particle,tstep);
+	std::vector<size_t> cell(last-first);
+	std::vector<size_t> offsets(cell_count.size()+1,0);
+
+	// counting sort on the cell index
+	for(size_t i=first;i<last;++i)
+	{
+		cell[i-first] = subToIdx(posToSub(store.pos[tstep][i]));
+		++offsets[cell[i-first]+1];
+	}
+
+	for(size_t c=1;c<offsets.size();++c)
+		offsets[c] += offsets[c-1];
+
+	std::vector<size_t> perm(last-first);
+	for(size_t i=0;i<cell.size();++i)
+		perm[offsets[cell[i]]++] = i;
+
+	store.permute(first,perm);
+	clear();
 }
 
 /**
- * Place an individual particle into the correct cell
+ * Put the particles with indices [first,last) of the store into the correct
+ * cells. Returns the number of particles which are in a different cell from
+ * the last time they were placed.
  */
 template<size_t Dim, typename T, size_t Padding>
-void LinkedCellGrid<Dim,T,Padding>::place(T& part, size_t tstep)
+size_t LinkedCellGrid<Dim,T,Padding>::place(T& store, size_t tstep, size_t first, size_t last)
+{
+	if(next.size()<last) next.resize(store.size());
+	if(part_cell.size()<last) part_cell.resize(store.size());
+
+	size_t changes = 0;
+	for(size_t i=first;i<last;++i)
+		if(place(store,tstep,i)) ++changes;
+
+	placed = last;
+
+	return changes;
+}
+
+/**
+ * As above but the cells are worked out in parallel using the given task
+ * scheduler, only adding the particles to the cells is done serially.
+ */
+template<size_t Dim, typename T, size_t Padding> template<class Scheduler>
+size_t LinkedCellGrid<Dim,T,Padding>::place(T& store, size_t tstep, size_t first, size_t last, Scheduler& sched)
 {
-	cells[subToIdx(posToSub(part.pos[tstep]))].push_back(part);
+	if(next.size()<last) next.resize(store.size());
+	if(part_cell.size()<last) part_cell.resize(store.size());
+
+	std::vector<size_t> changes(sched.threads(),0);
+	sched.parallelFor(first,last,[&](size_t i, size_t thread)
+	{
+		size_t idx = subToIdx(posToSub(store.pos[tstep][i]));
+		part_cell[i] = idx;
+		if(store.cell[i]!=idx) ++changes[thread];
+		store.cell[i] = idx;
+	});
+
+	for(size_t i=first;i<last;++i)
+		link(i);
+
+	placed = last;
+
+	size_t total = 0;
+	for(size_t c : changes) total += c;
+	return total;
 }
 
 /**
- * Appends the contents of the cell specified by a subscript to the list
- * given as the first paramter. Note that this copies the data.
+ * Place an individual particle into the correct cell. Returns true if the
+ * particle is in a different cell from the last time it was placed.
  */
 template<size_t Dim, typename T, size_t Padding>
-void LinkedCellGrid<Dim,T,Padding>::appendCellContents(fast_list<std::pair<T,T*>>& out, const Subscript<Dim>& sub)
+bool LinkedCellGrid<Dim,T,Padding>::place(T& store, size_t tstep, size_t part)
 {
-	// copy the cell contents and a pointer to where the copy came from
-	for(T& part : cells[subToIdx(sub)])
-		out.push_back(make_pair(part,&part));
+	if(next.size()<=part) next.resize(store.size());
+	if(part_cell.size()<=part) part_cell.resize(store.size());
+
+	size_t idx = subToIdx(posToSub(store.pos[tstep][part]));
+
+	part_cell[part] = idx;
+	link(part);
+
+	bool changed = store.cell[part]!=idx;
+	store.cell[part] = idx;
+	return changed;
+}
+
+/**
+ * Adds a particle to the cell recorded in part_cell.
+ */
+template<size_t Dim, typename T, size_t Padding>
+void LinkedCellGrid<Dim,T,Padding>::link(size_t part)
+{
+	size_t idx = part_cell[part];
+
+	if(sorted_mode)
+	{
+		placed = std::max(placed,part+1);
+		table_dirty = true;
+	}
+	else
+	{
+		if(heads[idx]==npos)
+			heads[idx] = part;
+		else
+			next[tails[idx]] = part;
+
+		tails[idx] = part;
+		next[part] = npos;
+		++cell_count[idx];
+	}
+}
+
+/**
+ * Appends the indices of the particles in the cell specified by a subscript to
+ * the vector given as the first paramter.
+ */
+template<size_t Dim, typename T, size_t Padding>
+void LinkedCellGrid<Dim,T,Padding>::appendCellContents(std::vector<size_t>& out, const Subscript<Dim>& sub)
+{
+	if(sorted_mode)
+		buildTable();
+
+	forEachInCell(subToIdx(sub),[&](size_t i){ out.push_back(i); });
+}
+
+/**
+ * Calls f with the index of each particle in the cell with the given index.
+ * In sorted mode the table must have been built.
+ */
+template<size_t Dim, typename T, size_t Padding> template<class F>
+void LinkedCellGrid<Dim,T,Padding>::forEachInCell(size_t idx, F&& f) const
+{
+	if(sorted_mode)
+	{
+		for(size_t k=cell_start[idx];k<cell_start[idx]+cell_count[idx];++k)
+			f(order[k]);
+	}
+	else
+	{
+		for(size_t i=heads[idx];i!=npos;i=next[i])
+			f(i);
+	}
 }
 
 /**
@@ -170,8 +450,10 @@ void LinkedCellGrid<Dim,T,Padding>::appendCellContents(fast_list<std::pair<T,T*>
 template<size_t Dim, typename T, size_t Padding>
 void LinkedCellGrid<Dim,T,Padding>::clear()
 {
-	for(auto& cell : cells)
-		cell.clear();
+	std::fill(heads.begin(),heads.end(),npos);
+	std::fill(cell_count.begin(),cell_count.end(),0);
+	placed = 0;
+	table_dirty = true;
 }
 
 /*
@@ -190,30 +472,29 @@ void LinkedCellGrid<Dim,T,Padding>::clear()
  */
 
 /**
- * Returns a copy of the particles in the specified border region along
- * with a pointer to the original for later updating.
+ * Fills out with the indices of the particles in the specified border region.
  */
 template<size_t Dim, class T, size_t Padding>
 template<size_t Loc>
-fast_list<std::pair<T,T*>> LinkedCellGrid<Dim,T,Padding>::getBorder()
+void LinkedCellGrid<Dim,T,Padding>::getBorder(std::vector<size_t>& out)
 {
-	fast_list<std::pair<T,T*>> list;
+	out.clear();
 
 	// get limits of the border region cell subscripts
 	Subscript<Dim> bmin = _lcg_impl<Dim,T,Padding,Loc>::borderMin(*this);
 	Subscript<Dim> bmax = _lcg_impl<Dim,T,Padding,Loc>::borderMax(*this);
 
-	// link the cell contents into neighbour list
+	// collect the cell contents
 	utils::multi_for(bmin,bmax,[&](const Subscript<Dim>& loop_pos)->void{
-		appendCellContents(list,loop_pos);
+		appendCellContents(out,loop_pos);
 	});
-
-	return list;
 }
 
 /**
  * Clears the padding at the specified location. Note that this doesn't delete
- * the particles it just removes them from the linked cell grid.
+ * the particles it just removes them from the linked cell grid. The particles
+ * in the padding must be the last placed, as the ghosts are, so that in sorted
+ * mode the table is left covering those before them.
  */
 template<size_t Dim, class T, size_t Padding>
 template<size_t Loc>
@@ -223,11 +504,22 @@ void LinkedCellGrid<Dim,T,Padding>::clearPadding()
 	Subscript<Dim> min = _lcg_impl<Dim,T,Padding,Loc>::paddingMin(*this);
 	Subscript<Dim> max = _lcg_impl<Dim,T,Padding,Loc>::paddingMax(*this);
 
-	// copy the cell contents
+	if(sorted_mode)
+		buildTable();
+
+	// empty the cells
 	utils::multi_for(min,max,[&](const Subscript<Dim>& loop_pos)->void{
-		cells[subToIdx(loop_pos)].clear();
-	});
+		size_t idx = subToIdx(loop_pos);
+
+		// the table still lists them, stop it covering any
+		if(sorted_mode)
+			forEachInCell(idx,[&](size_t i){ placed = std::min(placed,i); });
 
+		heads[idx] = npos;
+		tails[idx] = npos;
+		cell_start[idx] = 0;
+		cell_count[idx] = 0;
+	});
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,142 @@
+#include "OutputScheduler.hpp"
+
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+namespace sim
+{
+
+namespace
+{
+
+// times within this fraction of a period of a write are taken to be at it,
+// the simulated time is a sum of time steps so is rarely an exact multiple
+const double time_tolerance = 1e-6;
+
+}
+
+OutputScheduler::OutputScheduler()
+:last_step(std::numeric_limits<size_t>::max())
+,started(false)
+{
+}
+
+/**
+ * Adds a stream written every period of simulated time or, if period is zero,
+ * every interval steps, with both zero it is written after every step. The
+ * streams due at the same time are written in the order they were added.
+ * Returns the index of the stream.
+ */
+size_t OutputScheduler::addStream(const std::string& name, double period, size_t interval, writer_type write)
+{
+	Stream stream;
+	stream.name = name;
+	stream.period = std::max(period,0.0);
+	stream.interval = stream.period>0.0 ? 0 : std::max<size_t>(interval,1);
+	stream.write = write;
+	stream.next_time = 0.0;
+	stream.count = 0;
+	stream.seconds = 0.0;
+
+	stream_list.push_back(stream);
+	return stream_list.size()-1;
+}
+
+/**
+ * Starts the schedule at the given step and time, writing the streams due
+ * then. A restarted simulation has already written its output for that point
+ * so the first writes are the ones after it.
+ */
+void OutputScheduler::start(size_t step, double time, bool restarted)
+{
+	for(Stream& stream : stream_list)
+	{
+		if(stream.period<=0.0)
+			continue;
+
+		if(restarted)
+			stream.next_time = nextTime(stream,time);
+		else
+			stream.next_time = std::ceil(time/stream.period - time_tolerance)*stream.period;
+	}
+
+	// the steps are written after they are taken, not at the start
+	last_step = step;
+	started = true;
+
+	if(!restarted)
+		update(step,time);
+}
+
+/**
+ * Writes each stream which is due after step steps, at the simulated time
+ * time, and works out when it is next due.
+ */
+void OutputScheduler::update(size_t step, double time)
+{
+	if(!started)
+		start(step,time,false);
+
+	for(Stream& stream : stream_list)
+	{
+		if(!due(stream,step,time))
+			continue;
+
+		auto write_start = std::chrono::steady_clock::now();
+		stream.write(step,time);
+		stream.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now()-write_start).count();
+		++stream.count;
+
+		if(stream.period>0.0)
+			stream.next_time = nextTime(stream,time);
+	}
+
+	last_step = step;
+}
+
+size_t OutputScheduler::streams() const
+{
+	return stream_list.size();
+}
+
+const std::string& OutputScheduler::name(size_t stream) const
+{
+	return stream_list[stream].name;
+}
+
+/**
+ * The number of times the stream has been written.
+ */
+size_t OutputScheduler::writes(size_t stream) const
+{
+	return stream_list[stream].count;
+}
+
+/**
+ * Seconds spent in the stream's writer. A writer which hands its output to
+ * a background thread is only charged for the time it holds up the caller.
+ */
+double OutputScheduler::writeTime(size_t stream) const
+{
+	return stream_list[stream].seconds;
+}
+
+bool OutputScheduler::due(const Stream& stream, size_t step, double time) const
+{
+	if(stream.period>0.0)
+		return time >= stream.next_time - time_tolerance*stream.period;
+
+	return step!=last_step && step%stream.interval==0;
+}
+
+// the first multiple of the period after time
+double OutputScheduler::nextTime(const Stream& stream, double time) const
+{
+	return (std::floor(time/stream.period + time_tolerance) + 1.0)*stream.period;
+}
+
+} /* namespace sim */
@@ -0,0 +1,59 @@
+#ifndef OUTPUTSCHEDULER_HPP_
+#define OUTPUTSCHEDULER_HPP_
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace sim
+{
+
+/*
+ * Decides when each kind of output is written. Every stream, e.g. snapshots,
+ * probes or checkpoints, has its own writer and its own cadence, either an
+ * interval of simulated time or a number of steps, and the time spent in
+ * each writer is recorded so the cost of every stream can be reported.
+ *
+ * update() is called once before the time stepping and after every step with
+ * the same values on every process, so collective writers are called by all
+ * of them together.
+ */
+class OutputScheduler
+{
+public:
+	typedef std::function<void(size_t step, double time)> writer_type;
+
+	OutputScheduler();
+
+	size_t addStream(const std::string& name, double period, size_t interval, writer_type write);
+	void start(size_t step, double time, bool restarted);
+	void update(size_t step, double time);
+
+	size_t streams() const;
+	const std::string& name(size_t stream) const;
+	size_t writes(size_t stream) const;
+	double writeTime(size_t stream) const;
+
+private:
+	struct Stream
+	{
+		std::string	name;
+		double		period;		// simulated time between writes, 0 if by steps
+		size_t		interval;	// steps between writes, 0 if by time
+		writer_type	write;
+		double		next_time;	// when it is next due, if by time
+		size_t		count;		// writes made
+		double		seconds;	// spent writing
+	};
+
+	bool due(const Stream& stream, size_t step, double time) const;
+	double nextTime(const Stream& stream, double time) const;
+
+	std::vector<Stream>	stream_list;
+	size_t				last_step; // of the last update, a step is only written once
+	bool				started;
+};
+
+} /* namespace sim */
+
+#endif /* OUTPUTSCHEDULER_HPP_ */
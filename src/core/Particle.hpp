@@ -4,7 +4,6 @@
 #include <iostream>
 #include <list>
 #include <boost/mpi/datatype.hpp>
-#include <boost/intrusive/list.hpp>
 #include <dims.hpp>
 #include <vect.hpp>
 #include "../utils/utils.hpp"
@@ -29,7 +28,6 @@ class Particle
 public:
 	Particle();
 	Particle(const Particle<Dim,TStep,NCol>&);
-	virtual ~Particle(){};
 
 	Particle<Dim,TStep,NCol>&  operator= (const Particle<Dim,TStep,NCol>&);
 
@@ -54,15 +52,45 @@ public:
 	quantity<dims::density>				density[TStep];
 	quantity<dims::pressure>			pressure;
 	nvect<Dim,quantity<IntDim<0,-1,0>>>	gradC[NCol];
-
-	// hooks for multiply linked lists
-	boost::intrusive::list_member_hook<>
-		main_hook,			// for iterating over fluid/wall particles
-		lcg_hook;			// for iterating over linked-cell-grid cells
 };
 
-template<class T> using MainList      = boost::intrusive::list<T, boost::intrusive::member_hook<T, boost::intrusive::list_member_hook<>, &T::main_hook> >;
-template<class T> using LCGList       = boost::intrusive::list<T, boost::intrusive::member_hook<T, boost::intrusive::list_member_hook<>, &T::lcg_hook> >;
+/*
+ * The state of a particle as it is sent between processes. Unlike Particle it
+ * only holds fixed size arrays of built in types, so contiguous arrays of it
+ * can be sent as a committed MPI derived datatype without any serialization.
+ * Every member is 8 bytes wide so the struct has no padding.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+struct ParticleData
+{
+	// describes the layout for boost::mpi's datatype, not used for archives
+	template<class Archive> void serialize(Archive& a, const unsigned int version)
+	{
+		a & fluid;
+		a & wall;
+		a & id;
+		a & type;
+		a & pos;
+		a & vel;
+		a & acc;
+		a & sigma;
+		a & density;
+		a & pressure;
+		a & gradC;
+	}
+
+	size_t	fluid;
+	size_t	wall;
+	size_t	id;
+	size_t	type; // a ParticleType
+	double	pos[TStep][Dim];
+	double	vel[TStep][Dim];
+	double	acc[Dim];
+	double	sigma;
+	double	density[TStep];
+	double	pressure;
+	double	gradC[NCol][Dim];
+};
 
 template<size_t Dim, size_t TStep, size_t NCol>
 Particle<Dim,TStep,NCol>::Particle()
@@ -161,11 +189,11 @@ std::ostream& operator<<(std::ostream& out, const sim::Particle<Dim,TStep,NCol>&
 
 } /* namespace sim */
 
-// TODO: Currently we cannot optimize sending via boost::mpi since Particle is not a POD (also nvect is not POD)
-/*namespace boost { namespace mpi {
+// Particle itself is not a POD (nor is nvect) so whole particles are sent as ParticleData
+namespace boost { namespace mpi {
   template <size_t Dim, size_t TStep, size_t NCol>
-  struct is_mpi_datatype<sim::Particle<Dim,TStep,NCol> > : public mpl::true_ { };
-} }*/
+  struct is_mpi_datatype<sim::ParticleData<Dim,TStep,NCol> > : public mpl::true_ { };
+} }
 
 
 #endif /* PARTICLE_H_ */
@@ -0,0 +1,436 @@
+#ifndef PARTICLESTORE_HPP_
+#define PARTICLESTORE_HPP_
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <boost/serialization/vector.hpp>
+#include <dims.hpp>
+#include <vect.hpp>
+#include "Particle.hpp"
+#include "../utils/utils.hpp"
+
+namespace sim
+{
+
+using namespace dims;
+
+/*
+ * Gives [t] access to one particle's entry in an array of per-timestep
+ * vectors, so that part.pos[t] works the same for a ParticleRef as for a
+ * Particle.
+ */
+template<class T>
+class SlotRef
+{
+public:
+	SlotRef(std::vector<T>* slots, size_t idx)
+	:slots(slots)
+	,idx(idx)
+	{
+	}
+
+	T& operator[](size_t t) const { return slots[t][idx]; }
+
+private:
+	std::vector<T>* slots;
+	size_t			idx;
+};
+
+/*
+ * A proxy which refers to a single particle inside a ParticleStore. It exposes
+ * the same members as sim::Particle so the physics functors, which are
+ * templated on the particle type, can be used unchanged with either.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+class ParticleRef
+{
+public:
+	template<class Store>
+	ParticleRef(Store& s, size_t i)
+	:fluid(s.fluid[i])
+	,wall(s.wall[i])
+	,id(s.id[i])
+	,type(s.type[i])
+	,pos(s.pos,i)
+	,vel(s.vel,i)
+	,acc(s.acc[i])
+	,sigma(s.sigma[i])
+	,density(s.density,i)
+	,pressure(s.pressure[i])
+	,gradC(s.gradC,i)
+	,index(i)
+	{
+	}
+
+	// more than checking equality this checks whether they are the same particle
+	bool is(const ParticleRef<Dim,TStep,NCol>& part) const { return &sigma==&part.sigma; }
+
+	size_t&									fluid;
+	size_t&									wall;
+	size_t&									id;
+	ParticleType&							type;
+	SlotRef<nvect<Dim,quantity<position>>>	pos;
+	SlotRef<nvect<Dim,quantity<velocity>>>	vel;
+	nvect<Dim,quantity<acceleration>>&		acc;
+	quantity<IntDim<0,-(int)Dim,0>>&		sigma;
+	SlotRef<quantity<dims::density>>		density;
+	quantity<dims::pressure>&				pressure;
+	SlotRef<nvect<Dim,quantity<IntDim<0,-1,0>>>> gradC;
+
+	const size_t index; // position within the store
+};
+
+/*
+ * Structure-of-arrays storage for particles. Each property lives in its own
+ * contiguous array indexed by particle so that sweeps over the particles
+ * stream through memory rather than chasing list nodes. sim::Particle is
+ * still used as the value type when a whole particle has to be copied, e.g.
+ * for MPI exchange.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+class ParticleStore
+{
+public:
+	typedef Particle<Dim,TStep,NCol>		particle_type;
+	typedef ParticleData<Dim,TStep,NCol>	data_type;
+	typedef ParticleRef<Dim,TStep,NCol>		reference;
+
+	size_t size() const;
+	void clear();
+	void resize(size_t n);
+	void reserve(size_t n);
+
+	void push_back(const particle_type& part);
+	void push_back(const data_type& data);
+	void pop_back();
+	void remove(size_t i);
+
+	particle_type get(size_t i) const;
+	void set(size_t i, const particle_type& part);
+	void getData(size_t i, data_type& data) const;
+	void setData(size_t i, const data_type& data);
+	reference operator[](size_t i);
+
+	void permute(size_t first, const std::vector<size_t>& order);
+
+	template<class Archive> void serialize(Archive& a, const unsigned int version);
+	template<class Archive> void save(Archive& a, size_t n) const;
+
+	// the first n particles, archived as a store holding only them
+	struct Head
+	{
+		const ParticleStore&	store;
+		size_t					n;
+
+		template<class Archive> void serialize(Archive& a, const unsigned int version) { store.save(a,n); }
+	};
+	Head head(size_t n) const { return Head{*this,n}; }
+
+	// properties
+	std::vector<size_t>								fluid;
+	std::vector<size_t>								wall;
+	std::vector<size_t>								id;
+	std::vector<ParticleType>						type;
+	std::vector<nvect<Dim,quantity<position>>>		pos[TStep];
+	std::vector<nvect<Dim,quantity<velocity>>>		vel[TStep];
+	std::vector<nvect<Dim,quantity<acceleration>>>	acc;
+	std::vector<quantity<IntDim<0,-(int)Dim,0>>>	sigma;
+	std::vector<quantity<dims::density>>			density[TStep];
+	std::vector<quantity<dims::pressure>>			pressure;
+	std::vector<nvect<Dim,quantity<IntDim<0,-1,0>>>> gradC[NCol];
+
+	// bookkeeping, not part of the particle
+	std::vector<size_t>								cell;	 // cell the particle was last placed in
+
+private:
+	// apply an operation to every property array
+	template<class F> void forEachArray(F f);
+
+	// operations passed to forEachArray (no generic lambdas in C++11)
+	struct ClearOp	 { template<class V> void operator()(V& v) const { v.clear(); } };
+	struct PopOp	 { template<class V> void operator()(V& v) const { v.pop_back(); } };
+	struct ResizeOp	 { size_t n; template<class V> void operator()(V& v) const { v.resize(n); } };
+	struct ReserveOp { size_t n; template<class V> void operator()(V& v) const { v.reserve(n); } };
+	struct CopyOp	 { size_t to, from; template<class V> void operator()(V& v) const { v[to] = v[from]; } };
+
+	// the first n elements of v
+	template<class V> static V first(const V& v, size_t n) { return V(v.begin(),v.begin()+n); }
+	struct PermuteOp
+	{
+		size_t first;
+		const std::vector<size_t>& order;
+
+		template<class V> void operator()(V& v) const
+		{
+			V tmp(order.size());
+			for(size_t i=0;i<order.size();++i)
+				tmp[i] = v[first+order[i]];
+			std::copy(tmp.begin(),tmp.end(),v.begin()+first);
+		}
+	};
+};
+
+template<size_t Dim, size_t TStep, size_t NCol> template<class F>
+void ParticleStore<Dim,TStep,NCol>::forEachArray(F f)
+{
+	f(fluid);
+	f(wall);
+	f(id);
+	f(type);
+	for(size_t t=0;t<TStep;++t)
+	{
+		f(pos[t]);
+		f(vel[t]);
+		f(density[t]);
+	}
+	f(acc);
+	f(sigma);
+	f(pressure);
+	for(size_t c=0;c<NCol;++c)
+		f(gradC[c]);
+	f(cell);
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+size_t ParticleStore<Dim,TStep,NCol>::size() const
+{
+	return id.size();
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::clear()
+{
+	forEachArray(ClearOp());
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::resize(size_t n)
+{
+	forEachArray(ResizeOp{n});
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::reserve(size_t n)
+{
+	forEachArray(ReserveOp{n});
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::push_back(const particle_type& part)
+{
+	resize(size()+1);
+	set(size()-1,part);
+	cell.back() = std::numeric_limits<size_t>::max();
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::push_back(const data_type& data)
+{
+	resize(size()+1);
+	setData(size()-1,data);
+	cell.back() = std::numeric_limits<size_t>::max();
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::pop_back()
+{
+	forEachArray(PopOp());
+}
+
+/**
+ * Removes the particle at index i by moving the last particle into its place.
+ * Note that this does not preserve the ordering of the particles.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::remove(size_t i)
+{
+	size_t last = size()-1;
+	if(i!=last)
+		forEachArray(CopyOp{i,last});
+	pop_back();
+}
+
+/**
+ * Returns a copy of the particle at index i.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+typename ParticleStore<Dim,TStep,NCol>::particle_type ParticleStore<Dim,TStep,NCol>::get(size_t i) const
+{
+	particle_type part;
+	part.fluid = fluid[i];
+	part.wall = wall[i];
+	part.id = id[i];
+	part.type = type[i];
+	part.acc = acc[i];
+	part.sigma = sigma[i];
+	part.pressure = pressure[i];
+
+	for(size_t t=0;t<TStep;++t)
+	{
+		part.pos[t] = pos[t][i];
+		part.vel[t] = vel[t][i];
+		part.density[t] = density[t][i];
+	}
+
+	for(size_t c=0;c<NCol;++c)
+		part.gradC[c] = gradC[c][i];
+
+	return part;
+}
+
+/**
+ * Overwrites the particle at index i with the given particle.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::set(size_t i, const particle_type& part)
+{
+	fluid[i] = part.fluid;
+	wall[i] = part.wall;
+	id[i] = part.id;
+	type[i] = part.type;
+	acc[i] = part.acc;
+	sigma[i] = part.sigma;
+	pressure[i] = part.pressure;
+
+	for(size_t t=0;t<TStep;++t)
+	{
+		pos[t][i] = part.pos[t];
+		vel[t][i] = part.vel[t];
+		density[t][i] = part.density[t];
+	}
+
+	for(size_t c=0;c<NCol;++c)
+		gradC[c][i] = part.gradC[c];
+}
+
+/**
+ * Copies the particle at index i into the form sent between processes.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::getData(size_t i, data_type& data) const
+{
+	data.fluid = fluid[i];
+	data.wall = wall[i];
+	data.id = id[i];
+	data.type = type[i];
+	data.sigma = discard_dims(sigma[i]);
+	data.pressure = discard_dims(pressure[i]);
+
+	for(size_t d=0;d<Dim;++d)
+		data.acc[d] = discard_dims(acc[i][d]);
+
+	for(size_t t=0;t<TStep;++t)
+	{
+		for(size_t d=0;d<Dim;++d)
+		{
+			data.pos[t][d] = discard_dims(pos[t][i][d]);
+			data.vel[t][d] = discard_dims(vel[t][i][d]);
+		}
+		data.density[t] = discard_dims(density[t][i]);
+	}
+
+	for(size_t c=0;c<NCol;++c)
+		for(size_t d=0;d<Dim;++d)
+			data.gradC[c][d] = discard_dims(gradC[c][i][d]);
+}
+
+/**
+ * Overwrites the particle at index i with one received from another process.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::setData(size_t i, const data_type& data)
+{
+	fluid[i] = data.fluid;
+	wall[i] = data.wall;
+	id[i] = data.id;
+	type[i] = static_cast<ParticleType>(data.type);
+	sigma[i] = quantity<IntDim<0,-(int)Dim,0>>(data.sigma);
+	pressure[i] = quantity<dims::pressure>(data.pressure);
+
+	for(size_t d=0;d<Dim;++d)
+		acc[i][d] = quantity<acceleration>(data.acc[d]);
+
+	for(size_t t=0;t<TStep;++t)
+	{
+		for(size_t d=0;d<Dim;++d)
+		{
+			pos[t][i][d] = quantity<position>(data.pos[t][d]);
+			vel[t][i][d] = quantity<velocity>(data.vel[t][d]);
+		}
+		density[t][i] = quantity<dims::density>(data.density[t]);
+	}
+
+	for(size_t c=0;c<NCol;++c)
+		for(size_t d=0;d<Dim;++d)
+			gradC[c][i][d] = quantity<IntDim<0,-1,0>>(data.gradC[c][d]);
+}
+
+template<size_t Dim, size_t TStep, size_t NCol>
+typename ParticleStore<Dim,TStep,NCol>::reference ParticleStore<Dim,TStep,NCol>::operator[](size_t i)
+{
+	return reference(*this,i);
+}
+
+/**
+ * Reorders the particles starting at index first so that the particle at
+ * first+order[i] moves to first+i.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+void ParticleStore<Dim,TStep,NCol>::permute(size_t first, const std::vector<size_t>& order)
+{
+	forEachArray(PermuteOp{first,order});
+}
+
+template<size_t Dim, size_t TStep, size_t NCol> template<class Archive>
+void ParticleStore<Dim,TStep,NCol>::serialize(Archive& a, const unsigned int version)
+{
+	a & fluid;
+	a & wall;
+	a & id;
+	a & type;
+	a & pos;	 // note: boost automatically handles static arrays
+	a & vel;
+	a & acc;
+	a & sigma;
+	a & density;
+	a & pressure;
+	a & gradC;
+}
+
+/**
+ * Writes the first n particles, e.g. leaving out the ghosts, in the same form
+ * as serialize() so they are read back by it, see head().
+ */
+template<size_t Dim, size_t TStep, size_t NCol> template<class Archive>
+void ParticleStore<Dim,TStep,NCol>::save(Archive& a, size_t n) const
+{
+	std::vector<nvect<Dim,quantity<position>>>		 pos_head[TStep];
+	std::vector<nvect<Dim,quantity<velocity>>>		 vel_head[TStep];
+	std::vector<quantity<dims::density>>			 density_head[TStep];
+	std::vector<nvect<Dim,quantity<IntDim<0,-1,0>>>> gradC_head[NCol];
+	for(size_t t=0;t<TStep;++t)
+	{
+		pos_head[t] = first(pos[t],n);
+		vel_head[t] = first(vel[t],n);
+		density_head[t] = first(density[t],n);
+	}
+	for(size_t c=0;c<NCol;++c)
+		gradC_head[c] = first(gradC[c],n);
+
+	a << first(fluid,n);
+	a << first(wall,n);
+	a << first(id,n);
+	a << first(type,n);
+	a << pos_head;
+	a << vel_head;
+	a << first(acc,n);
+	a << first(sigma,n);
+	a << density_head;
+	a << first(pressure,n);
+	a << gradC_head;
+}
+
+} /* namespace sim */
+
+#endif /* PARTICLESTORE_HPP_ */
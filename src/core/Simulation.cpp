@@ -1,9 +1,7 @@
 #include "Simulation.hpp"
 
 #include <boost/mpi/nonblocking.hpp>
-#include <boost/mpi/skeleton_and_content.hpp>
-#include <boost/serialization/list.hpp>
-#include <boost/serialization/utility.hpp>
+#include <boost/serialization/vector.hpp>
 
 using namespace std;
 using namespace boost;
@@ -32,9 +30,10 @@ void Simulation<2>::floodFill(const Region<2>& region, const nvect<2,quantity<po
 			part.type = FluidP;
 			part.pos[1] = part.pos[0] = nvect<2,quantity<number>>(i,j)*params.dx + region.lower + make_vect<2,quantity<length>>(params.dx/2.0_number);
 
-			if(ldomain.inside(part.pos[0]))
+			if(owns(part.pos[0]))
 			{
-				fluid_particles.push_back(part);
+				particles.push_back(part);
+				++num_owned;
 			}
 		}
 }
@@ -52,15 +51,18 @@ template<> Subscript<2> Simulation<2>::shifts[8] = { {-1, 0}, // left
 template<> size_t Simulation<2>::send_tags[8] = { Left, Right, Top, Bottom, Bottom|Left, Top|Left, Top|Right, Bottom|Right };
 template<> size_t Simulation<2>::recv_tags[8] = { Right, Left, Bottom, Top, Top|Right, Bottom|Right, Bottom|Left, Top|Left }; // The process to our left (for example) is sending data to its right.
 
+template<> void Simulation<2>::finishExchangeData(); // used before they are defined
+template<> void Simulation<2>::finishExchangeFull();
+
 /**
- * Exchanges particles at the border with neighbouring processes and places
- * the received particles into the linked cell grid. Note that this just
- * means each processor can see the particles of neighbouring processors
- * if a particle moves such that it now needs to be handled by a different
- * processor then exchangeOutOfBounds() must be called.
+ * Starts exchangeFull(), dropping the old ghosts, copying the particles to
+ * send and posting the messages. Until finishExchangeFull() is called there
+ * are no ghosts, only the particles away from the cells we send may be
+ * summed. If doSPHSum() is called first it will finish the exchange itself,
+ * part way through.
  */
 template<>
-void Simulation<2>::exchangeFull()
+void Simulation<2>::beginExchangeFull()
 {
 
 	/*if(comm_rank==4)
@@ -88,165 +90,204 @@ void Simulation<2>::exchangeFull()
 			}
 	}*/
 
+	finishExchange();
+
 	/*
 	 * Clear previously any exchanged particles
 	 */
 
-	cells.clearPadding<Left>();
-	cells.clearPadding<Right>();
-	cells.clearPadding<Bottom>();
-	cells.clearPadding<Top>();
-	cells.clearPadding<Bottom|Left>();
-	cells.clearPadding<Bottom|Right>();
-	cells.clearPadding<Top|Right>();
-	cells.clearPadding<Top|Left>();
+	if(curve!=NoCurve)
+	{
+		// the ghosts may be in any cell we don't own so place our particles again
+		if(particles.size()>num_owned)
+		{
+			cells.clear();
+			particles.resize(num_owned);
+			cells.place(particles,place_tstep,0,num_owned);
+		}
+
+		if(cells.sorted())
+			cells.buildTable();
 
-	for(size_t i=0;i<hc_elements(2);++i)
+		// get the particles in the cells each neighbour needs
+		for(size_t i=0;i<halo.neighbours();++i)
+		{
+			send_index[i].clear();
+			for(size_t idx : send_cells[i])
+				cells.forEachInCell(idx,[&](size_t k){ send_index[i].push_back(k); });
+		}
+	}
+	else
 	{
-		recv_particles[i].clear();
-		send_particles[i].clear();
+		cells.clearPadding<Left>();
+		cells.clearPadding<Right>();
+		cells.clearPadding<Bottom>();
+		cells.clearPadding<Top>();
+		cells.clearPadding<Bottom|Left>();
+		cells.clearPadding<Bottom|Right>();
+		cells.clearPadding<Top|Right>();
+		cells.clearPadding<Top|Left>();
+
+		particles.resize(num_owned);
+
+		// get the particles in each part to send
+		cells.getBorder<Left>(send_index[0]);
+		cells.getBorder<Right>(send_index[1]);
+		cells.getBorder<Top>(send_index[2]);
+		cells.getBorder<Bottom>(send_index[3]);
+		cells.getBorder<Bottom|Left>(send_index[4]);
+		cells.getBorder<Top|Left>(send_index[5]);
+		cells.getBorder<Top|Right>(send_index[6]);
+		cells.getBorder<Bottom|Right>(send_index[7]);
 	}
 
 	/*
 	 * Send & receive the data.
 	 */
 
-	mpi::request skeleton_reqs[hc_elements(2)*2]; // send and receive
-	mpi::request content_reqs[hc_elements(2)*2];  // send and receive
-
-	// get the data from each part to send
-	send_particles[0] = cells.getBorder<Left>();
-	send_particles[1] = cells.getBorder<Right>();
-	send_particles[2] = cells.getBorder<Top>();
-	send_particles[3] = cells.getBorder<Bottom>();
-	send_particles[4] = cells.getBorder<Bottom|Left>();
-	send_particles[5] = cells.getBorder<Top|Left>();
-	send_particles[6] = cells.getBorder<Top|Right>();
-	send_particles[7] = cells.getBorder<Bottom|Right>();
-
-	// send and receive skeleton
-	for(size_t i=0;i<hc_elements(2);++i)
+	for(size_t i=0;i<halo.neighbours();++i)
 	{
-		skeleton_reqs[i*2]   = comm.isend(dest_ranks[i],send_tags[i],mpi::skeleton(send_particles[i]));
-		skeleton_reqs[i*2+1] = comm.irecv(dest_ranks[i],recv_tags[i],mpi::skeleton(recv_particles[i]));
-	};
-
-	// wait for skeleton exchanges to finish
-	mpi::wait_all(skeleton_reqs,skeleton_reqs+2*hc_elements(2));
+		data_type* buf = halo.sendBuffer(i,send_index[i].size());
+		for(size_t k=0;k<send_index[i].size();++k)
+			particles.getData(send_index[i][k],buf[k]);
+	}
 
-	// swap the data
-	mpi::content send_c[hc_elements(2)];
-	mpi::content recv_c[hc_elements(2)];
-	for(size_t i=0;i<hc_elements(2);++i)
-	{
-		send_c[i] = mpi::get_content(send_particles[i]);
-		recv_c[i] = mpi::get_content(recv_particles[i]);
+	// the ghosts will only be next to the cells we send
+	findBorderCells();
 
-		content_reqs[i*2]   = comm.isend(dest_ranks[i],send_tags[i],send_c[i]);
-		content_reqs[i*2+1] = comm.irecv(dest_ranks[i],recv_tags[i],recv_c[i]);
-	}
+	// swap the data, the plan resizes its buffers if the counts have outgrown them
+	halo.start();
+	exchange_in_flight = true;
+	full_exchange = true;
+	++pos_epoch; // the ghosts have gone
+}
 
-	// wait for data to exchange
-	mpi::wait_all(content_reqs,content_reqs+2*hc_elements(2));
+/**
+ * Waits for the messages posted by beginExchangeFull() and places the ghosts
+ * received into the linked cell grid.
+ */
+template<>
+void Simulation<2>::finishExchangeFull()
+{
+	halo.wait();
+	exchange_in_flight = false;
+	full_exchange = false;
 
 	/*
 	 * Handle received data
 	 */
 
-	for(size_t i=0;i<hc_elements(2);++i)
-	{
-		// if we are on a period boundary, shift the data we received across the period
-		for(size_t d=0;d<2;++d)
-		{
-			// received from +Period
-			if(dest_periods[i][d]==PeriodDirec::Positive)
-				for(auto& part : recv_particles[i])
-				{
-					part.first.pos[0][d] -= gdomain.upper[d];
-					part.first.pos[1][d] -= gdomain.upper[d];
-				}
-
-			// received from zero
-			if(dest_periods[i][d]==PeriodDirec::Negative)
-				for(auto& part : recv_particles[i])
-				{
-					part.first.pos[0][d] += gdomain.upper[d];
-					part.first.pos[1][d] += gdomain.upper[d];
-				}
-		}
-	}
+	for(size_t i=0;i<halo.neighbours();++i)
+		shiftReceived(i);
 
-	// add to linked cell grid
-	for(auto& l : recv_particles)
+	// append the ghosts to the store and add them to the linked cell grid
+	size_t num_ghosts = 0;
+	for(size_t i=0;i<halo.neighbours();++i)
+		num_ghosts += halo.recvCount(i);
+	particles.reserve(num_owned+num_ghosts);
+
+	for(size_t i=0;i<halo.neighbours();++i)
 	{
-		for(auto& p : l)
+		recv_offset[i] = particles.size();
+		data_type* buf = halo.recvBuffer(i);
+		for(size_t k=0;k<halo.recvCount(i);++k)
 		{
-			cells.place(p.first,0);
-			p.first.type = GhostP; // FOR DEBUG
+			buf[k].type = GhostP;
+			particles.push_back(buf[k]);
 		}
 	}
+
+	cells.place(particles,place_tstep,num_owned,particles.size());
+
+	// a sum which finished the exchange carries on with the ghosts in place
+	if(cells.sorted())
+		cells.buildTable();
 }
 
 /**
- * Doesn't exchange the particles themselves or place them into the lcg
- * it just updates the values on previously exchanged particles.
+ * Exchanges particles at the border with neighbouring processes and places
+ * the received particles into the linked cell grid. Note that this just
+ * means each processor can see the particles of neighbouring processors
+ * if a particle moves such that it now needs to be handled by a different
+ * processor then exchangeOutOfBounds() must be called.
  */
 template<>
-void Simulation<2>::exchangeData()
+void Simulation<2>::exchangeFull()
 {
+	beginExchangeFull();
+	finishExchangeFull();
+}
+
+/**
+ * Starts exchangeData(), copying the values to send and posting the messages.
+ * The particles we own may be changed before finishExchangeData() is called
+ * but the ghosts must be left alone. If doSPHSum() is called first it will
+ * finish the exchange itself, part way through.
+ */
+template<>
+void Simulation<2>::beginExchangeData()
+{
+	finishExchange();
+
 	/*
 	 * When we copied the neighbouring particles for sending before, we also stored
-	 * a pointer to the originating particle. Use this to copy the values and then
+	 * the index of the originating particle. Use this to copy the values and then
 	 * exchange them.
 	 */
 
-	mpi::content sc[hc_elements(2)];
-	mpi::content rc[hc_elements(2)];
-	mpi::request reqs[hc_elements(2)*2];
-	for(size_t i=0;i<hc_elements(2);++i)
+	for(size_t i=0;i<halo.neighbours();++i)
 	{
-		// copy the calculated values into our send buffered particles
-		for(auto& ppair : send_particles[i])
-			ppair.first = *ppair.second;
-
-		// exchange
-		sc[i] = mpi::get_content(send_particles[i]);
-		rc[i] = mpi::get_content(recv_particles[i]);
-		reqs[i*2]   = comm.isend(dest_ranks[i],send_tags[i],sc[i]);
-		reqs[i*2+1] = comm.irecv(dest_ranks[i],recv_tags[i],rc[i]);
+		// copy the calculated values into the send buffers
+		data_type* buf = halo.sendBuffer(i,send_index[i].size());
+		for(size_t k=0;k<send_index[i].size();++k)
+			particles.getData(send_index[i][k],buf[k]);
 	}
 
+	// exchange, the number of particles is unchanged since exchangeFull()
+	halo.start();
+	exchange_in_flight = true;
+}
+
+/**
+ * Waits for the messages posted by beginExchangeData() and copies the received
+ * values onto the ghosts.
+ */
+template<>
+void Simulation<2>::finishExchangeData()
+{
 	// wait for data exchange to finish
-	mpi::wait_all(reqs,reqs+hc_elements(2)*2);
+	halo.wait();
+	exchange_in_flight = false;
 
 	/*
 	 * Handle received data
 	 */
 
-	for(size_t i=0;i<hc_elements(2);++i)
+	for(size_t i=0;i<halo.neighbours();++i)
 	{
-		// if we are on a period boundary, shift the data we received across the period
-		for(size_t d=0;d<2;++d)
+		shiftReceived(i);
+
+		// update the ghosts in the store
+		data_type* buf = halo.recvBuffer(i);
+		for(size_t k=0;k<halo.recvCount(i);++k)
 		{
-			// received from +Period
-			if(dest_periods[i][d]==PeriodDirec::Positive)
-				for(auto& part : recv_particles[i])
-				{
-					part.first.pos[0][d] -= gdomain.upper[d];
-					part.first.pos[1][d] -= gdomain.upper[d];
-				}
-
-			// received from zero
-			if(dest_periods[i][d]==PeriodDirec::Negative)
-				for(auto& part : recv_particles[i])
-				{
-					part.first.pos[0][d] += gdomain.upper[d];
-					part.first.pos[1][d] += gdomain.upper[d];
-				}
+			buf[k].type = GhostP;
+			particles.setData(recv_offset[i]+k,buf[k]);
 		}
 	}
 }
 
+/**
+ * Doesn't exchange the particles themselves or place them into the lcg
+ * it just updates the values on previously exchanged particles.
+ */
+template<>
+void Simulation<2>::exchangeData()
+{
+	beginExchangeData();
+	finishExchangeData();
+}
+
 template<>
 vector<Subscript<2>> Simulation<2>::getStencil()
 {
@@ -3,17 +3,34 @@
 
 #include <vector>
 #include <list>
+#include <deque>
+#include <map>
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <typeinfo>
+#include <type_traits>
+#include <numeric>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <limits>
 //#include <initializer_list>
 #include <spud>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/mpi/communicator.hpp>
 #include <boost/mpi/collectives.hpp>
+#include <boost/mpi/operations.hpp>
 #include "ListSerializer.hpp"
 #include "LinkedCellGrid.hpp"
+#include "ParticleStore.hpp"
+#include "TaskScheduler.hpp"
+#include "AsyncWriter.hpp"
+#include "HaloPlan.hpp"
+#include "SnapshotFile.hpp"
+#include "HDF5File.hpp"
+#include "CompressedArchive.hpp"
 #include "Parameters.h"
 #include "Fluid.h"
 #include "Region.hpp"
@@ -28,6 +45,64 @@ using namespace std;
 using namespace dims;
 using namespace utils;
 
+/*
+ * Functions passed to applyFunctions() which move particles should specialise
+ * this so that any cached pair data is thrown away afterwards.
+ */
+template<class F>
+struct moves_particles : std::false_type {};
+
+template<typename... Fs>
+struct any_moves_particles : std::false_type {};
+
+template<typename F, typename... Fs>
+struct any_moves_particles<F,Fs...> : std::integral_constant<bool,
+		moves_particles<typename std::decay<F>::type>::value || any_moves_particles<Fs...>::value> {};
+
+/*
+ * Functions passed to doSPHSum() which only use the kernel value, not the
+ * distance, direction or gradient, should specialise this so that the
+ * square roots can be skipped with a kernel which has BatchSq().
+ */
+template<class F>
+struct kernel_only : std::false_type {};
+
+template<typename... Fs>
+struct all_kernel_only : std::true_type {};
+
+template<typename F, typename... Fs>
+struct all_kernel_only<F,Fs...> : std::integral_constant<bool,
+		kernel_only<typename std::decay<F>::type>::value && all_kernel_only<Fs...>::value> {};
+
+/*
+ * How doSPHSum() evaluates a kernel: with its BatchSq() function, many
+ * squared distances at once like kernels::TabulatedKernel, with Batch(), many
+ * distances at once like kernels::WendlandQuintic, or if it only has Kernel()
+ * and Grad() then one pair at a time.
+ */
+enum KernelBatching
+{
+	ScalarKernel,
+	BatchKernel,
+	BatchSqKernel
+};
+
+template<class K, class = void>
+struct has_batch : std::false_type {};
+
+template<class K>
+struct has_batch<K,decltype((void)&K::Batch)> : std::true_type {};
+
+template<class K, class = void>
+struct has_batch_sq : std::false_type {};
+
+template<class K>
+struct has_batch_sq<K,decltype((void)&K::BatchSq)> : std::true_type {};
+
+template<class K>
+struct kernel_batching : std::integral_constant<int,
+		has_batch_sq<K>::value ? BatchSqKernel : has_batch<K>::value ? BatchKernel : ScalarKernel> {};
+
 enum PeriodDirec
 {
 	Positive, // exchanging to the right
@@ -42,10 +117,20 @@ public:
 	/*
 	 * Useful typedefs
 	 */
-	typedef sim::Particle<Dim,2,2> particle_type;
-	typedef fast_list<particle_type> plist_type;
-	typedef MainList<particle_type>  mainplist_type;
+	typedef sim::Particle<Dim,2,2>		particle_type;
+	typedef sim::ParticleData<Dim,2,2>	data_type;	 // particle as sent between processes
+	typedef sim::ParticleStore<Dim,2,2>	store_type;
+
+	// where a simulation restarted from a checkpoint carries on from
+	struct RestartPoint
+	{
+		RestartPoint() : restarted(false), time(0.0), step(0), file_number(0) {}
 
+		bool	restarted;
+		double	time;
+		size_t	step;		 // steps taken
+		size_t	file_number; // of the next output
+	};
 
 	Simulation();
 	virtual ~Simulation(){};
@@ -54,6 +139,12 @@ public:
 	void loadConfigXML(std::string fname);
 	void loadWall(std::string fname);
 	void writeOutput(size_t file_no);
+	void writeSharedFile(size_t file_no);
+	void writeHDF5(size_t file_no);
+	void finishOutput();
+	void writeCheckpoint(size_t step, double time, size_t file_no);
+	template<template<int> class K> void writeProbes(double time);
+	void loadCheckpoint(const std::string& fname);
 	template<class Archive> void serialize(Archive& a, const unsigned int version);
 
 	// Setup
@@ -63,20 +154,70 @@ public:
 
 	// Simulate
 	void exchangeFull();
+	void beginExchangeFull();
+	void finishExchangeFull();
 	void exchangeData();
-	void exchangeOutOfBounds(size_t tstep);
+	void beginExchangeData();
+	void finishExchangeData();
+	void finishExchange();
+	template<typename F, typename... Fs> void exchangeData(F&& f, Fs&&... fs);
+	void beginTimestepReduction(size_t tstep);
+	void finishTimestepReduction();
+	template<typename... Fs> void exchangeOutOfBounds(size_t tstep, Fs&&... fs);
 	void placeParticlesIntoLinkedCellGrid(size_t tstep);
+	void buildNeighbourLists(size_t tstep);
+	template<typename... Fs> void updateNeighbours(size_t tstep, Fs&&... fs);
+	bool balanceLoad(size_t tstep);
 	template<template<int> class K, typename... Fs> void doSPHSum(size_t tstep, Fs&&... fs);
 	template<typename... Fs> void applyFunctions(Fs&&... fs);
 
 	const Parameters<Dim>& parameters() const;
 	const vector<Fluid>& fluidPhases() const;
-	const mainplist_type& fluidParticles() const;
-	const mainplist_type& wallParticles() const;
+	const store_type& particleStore() const;
+	size_t ownedCount() const;
+	size_t cellChanges() const;
+	const TaskScheduler& taskScheduler() const;
+	bool fusedPipeline() const;
+	bool overlapExchange() const;
+	bool adaptiveTimestep() const;
+	double outputTime() const;
+	size_t checkpointInterval() const;
+	size_t probeCount() const;
+	double probeInterval() const;
+	const RestartPoint& restartPoint() const;
 
 private:
 
 	std::vector<Subscript<Dim>> getStencil();
+	void applyDecomposition();
+	void findCuts(const std::vector<double>& weights, size_t min_cells, std::vector<size_t>& cuts);
+	void balanceSlabs(size_t tstep, double weight);
+	void initCurve();
+	void applyCurve();
+	void balanceCurve(size_t tstep, double weight);
+	size_t globalCell(const nvect<Dim,quantity<position>>& pos, Subscript<Dim>& wrap) const;
+	size_t linkKey(int rank, const Subscript<Dim>& wrap) const;
+	bool owns(const nvect<Dim,quantity<position>>& pos);
+	int ownerOf(const nvect<Dim,quantity<position>>& pos) const;
+	void sendToOwners(size_t tstep);
+	SnapshotHeader snapshotHeader(size_t file_no) const;
+	void shiftReceived(size_t i);
+	void writeAsync(size_t file_no);
+	std::string archiveName(size_t file_no) const;
+	template<class State> void writeArchive(const std::string& fname, const State& state) const;
+	template<class F> void forEachCandidate(size_t a, const Subscript<Dim>& x_sub, F&& visit);
+	template<class F> void forEachOwned(F&& f);
+	template<class F> void forEachOwnedColoured(F&& f);
+	void colourCells();
+	void findBorderCells();
+	bool touchesGhosts(size_t a, size_t tstep);
+	template<typename... Fs> void applyPair(typename store_type::reference& a, typename store_type::reference& b, const kernels::ParticleDelta<Dim>& delta, Fs&&... fs);
+	struct PairBatch;
+	template<template<int> class K> bool evaluateKernel(PairBatch& batch, bool distances);
+	template<template<int> class K> bool evaluateKernel(PairBatch& batch, bool distances, std::integral_constant<int,ScalarKernel>);
+	template<template<int> class K> bool evaluateKernel(PairBatch& batch, bool distances, std::integral_constant<int,BatchKernel>);
+	template<template<int> class K> bool evaluateKernel(PairBatch& batch, bool distances, std::integral_constant<int,BatchSqKernel>);
+	template<typename... Fs> void applyToParticle(size_t i, Fs&&... fs);
 
 	boost::mpi::communicator comm;
 	size_t comm_size;
@@ -88,17 +229,52 @@ private:
 	Region<Dim>	   ldomain;       // local domain extent
 	Region<Dim>	   pdomain;		  // padded local domain extent
 
+	// the domains are slabs of whole cells along each axis, domain_sub[d] covers
+	// global cells cell_cuts[d][domain_sub[d]] to cell_cuts[d][domain_sub[d]+1]-1
+	qvect<Dim,length>	cell_sizes;
+	Extent<Dim>			global_cell_counts;
+	std::vector<size_t>	cell_cuts[Dim];
+
+	// alternatively the global cells are ordered along a space filling curve,
+	// which is cut into one segment per process
+	enum Curve { NoCurve, Morton, Hilbert };
+	Curve								curve;
+	std::vector<size_t>					curve_order; // global cell indices along the curve
+	std::vector<size_t>					curve_cuts;	 // rank r owns curve_order[curve_cuts[r]] to [curve_cuts[r+1]-1]
+	std::vector<int>					cell_owner;	 // rank owning each global cell
+	Subscript<Dim>						grid_origin; // global subscript of the first cell of the local grid
+	std::vector<std::vector<size_t>>	send_cells;	 // local cells sent to each neighbour
+	std::map<size_t,size_t>				link_index;	 // neighbour for each linkKey()
+
 	std::string			root;   // output filename root
+
+	// how writeOutput() writes the particles
+	enum OutputFormat { PerProcess, SharedFile, HDF5 };
+	OutputFormat		output_format;
+	size_t				hdf5_chunk;		  // particles per chunk of the HDF5 datasets, 0 for none
+	int					hdf5_compression; // gzip level of the HDF5 datasets, 0 for none
+	Compression			compression;	  // of the per process files
+	int					compression_level; // negative for the compressor's default
+	bool				compact_output;	  // write only the selected fields to the per process files, see writeArchive()
+	OutputFields		output_fields;
+	QuantisationBounds	quantisation;
 	Parameters<Dim>		params; // physical parameters
 	std::vector<Fluid>	fluids; // fluid parameters
 
-	// lists for storing particles
-	plist_type fluid_particles;
-	plist_type wall_particles;
-
-	// buffers for sending across mpi
-	fast_list<std::pair<particle_type,particle_type*> > recv_particles[hc_elements(Dim)];
-	fast_list<std::pair<particle_type,particle_type*> > send_particles[hc_elements(Dim)];
+	// fluid and wall particles we own occupy [0,num_owned), ghosts copied from
+	// neighbouring processes follow them
+	store_type	particles;
+	size_t		num_owned;
+
+	// buffers and requests for exchanging ghosts with each neighbour, in the order
+	// of shifts or of the links found by applyCurve()
+	HaloPlan<data_type>					halo;
+	HaloPlan<data_type>					migration;		 // particles moving to another domain
+	std::vector<std::vector<data_type>>	leaving;		 // migrating particles being sorted by neighbour
+	bool								check_migration; // check they arrived in the right domain
+	std::vector<std::vector<size_t>>	send_index;		 // where each sent particle came from
+	std::vector<size_t>					recv_offset;	 // where the received ghosts start
+	std::vector<Subscript<Dim>>			link_wraps;		 // periods to move the ghosts from each neighbour by
 
 	// values needed during exchange - stored here to save recreating each time
 	Subscript<Dim>	dest_subs[hc_elements(Dim)];
@@ -112,11 +288,174 @@ private:
 	// stencil used for iterating nearby cell
 	std::vector<Subscript<Dim>> stencil;
 
-	LinkedCellGrid<Dim,particle_type,1> cells;
+	LinkedCellGrid<Dim,store_type,1> cells;
+	size_t place_tstep; // timestep used to place particles into the cells
+
+	// cell-sorted particle ordering
+	size_t sort_interval; // re-sort every this many steps, 0 disables sorting
+	size_t sort_counter;  // steps since the simulation started
+	size_t cell_changes;  // particles which changed cell at the last placement
+
+	// verlet neighbour lists, nbr_list[nbr_start[a]] to nbr_list[nbr_start[a+1]-1]
+	// are the particles within 2h+skin of a, using the same half stencil as the cells
+	bool								use_neighbour_lists;
+	bool								neighbours_valid; // lists match the current particle indices
+	quantity<length>					skin;
+	std::vector<size_t>					nbr_start;
+	std::vector<size_t>					nbr_list;
+	std::vector<char>					nbr_ghosts; // whether a's list holds any ghosts
+	std::vector<nvect<Dim,quantity<position>>> build_pos; // positions when the lists were built
+
+	// pairs found by the first SPH sum over a set of positions, replayed by
+	// later sums until pos_epoch changes
+	size_t									pos_epoch;	 // incremented whenever positions or particle indices change
+	size_t									cache_epoch;
+	size_t									cache_tstep;
+	const std::type_info*					cache_kernel;
+	bool									cache_distances; // the deltas have their distances, directions and gradients
+	std::vector<size_t>						cache_thread; // buffer holding the pairs of each particle
+	std::vector<size_t>						cache_start;  // a pairs with cache_b[cache_thread[a]][cache_start[a]]
+	std::vector<size_t>						cache_end;	  // to cache_b[cache_thread[a]][cache_end[a]-1]
+	std::vector<std::vector<size_t>>		cache_b;	  // one buffer per thread
+	std::vector<std::vector<kernels::ParticleDelta<Dim>>> cache_delta;
+
+	// pairs within 2h gathered for batch evaluation of the kernel, one per thread
+	struct PairBatch
+	{
+		std::vector<qvect<Dim,length>> r;	 // separation
+		std::vector<double> dist2;			 // squared distance
+		std::vector<double> dist;
+		std::vector<double> inv_dist;
+		std::vector<double> W;
+		std::vector<double> dW;
+	};
+	std::vector<PairBatch> pair_batches;
+
+	// threading within the process
+	TaskScheduler						scheduler;	  // runs work on the threads of this process
+	std::vector<std::vector<size_t>>	colour_cells; // cells of each colour, see colourCells()
+
+	bool fused_pipeline; // fold per-particle stages into the neighbouring passes
+
+	// overlapping ghost exchange with the SPH sums
+	bool				overlap_exchange;	// leave exchanges in flight for the next doSPHSum()
+	bool				exchange_in_flight; // beginExchangeData() or beginExchangeFull() has been called but not finished
+	bool				full_exchange;		// the exchange in flight is from beginExchangeFull()
+	std::vector<char>	border_cells;		// cells next to the ghosts, see findBorderCells()
+
+	// load balancing, see balanceLoad()
+	size_t	balance_interval;  // steps between checks, 0 disables balancing
+	double	balance_threshold; // rebalance once max/mean load - 1 exceeds this
+	bool	balance_by_time;   // measure load by time in doSPHSum() rather than particle count
+	size_t	balance_counter;
+	double	sum_time;		   // seconds spent in doSPHSum() since the last check
+	bool	rebalancing;	   // walls are migrated too
+
+	// adaptive time stepping, see beginTimestepReduction()
+	bool		adaptive_dt;
+	double		cfl_factor;		// dt <= cfl_factor*h/(c+|v|)
+	double		force_factor;	// dt <= force_factor*sqrt(h/|a|)
+	double		viscous_factor; // dt <= viscous_factor*h^2*rho/mu
+	double		dt_min;
+	double		dt_max;
+	double		dt_local;		// this process's limit, read by the reduction while it is in flight
+	double		dt_global;
+	MPI_Request	dt_request;
+	bool		dt_in_flight;
+
+	// what the per process files hold, copied so it can be written while the
+	// simulation carries on
+	struct OutputState
+	{
+		Parameters<Dim>		params;
+		Region<Dim>			gdomain;
+		Region<Dim>			ldomain;
+		std::vector<Fluid>	fluids;
+		size_t				num_owned; // the ghosts after them aren't written
+		store_type			particles;
+
+		template<class Archive> void serialize(Archive& a, const unsigned int version);
+	};
+
+	// the same with only the selected fields of the owned particles
+	struct CompactState
+	{
+		Parameters<Dim>				params;
+		Region<Dim>					gdomain;
+		Region<Dim>					ldomain;
+		std::vector<Fluid>			fluids;
+		CompactParticles<Dim,2>		particles;
+
+		template<class Archive> void serialize(Archive& a, const unsigned int version);
+	};
+
+	// writing in the background, see writeAsync(), the writer is declared after
+	// the staging so it is destroyed first, finishing its jobs while they exist
+	std::vector<std::unique_ptr<OutputState>>	staging;	  // one per snapshot the writer may be behind, used in turn
+	AsyncWriter									writer;
+	size_t										staged_count; // snapshots handed to the writer
+	double										output_time;  // seconds the simulation has spent held up by output
+
+	// checkpoints, see writeCheckpoint()
+	size_t			checkpoint_interval; // steps between checkpoints, 0 for none
+	size_t			checkpoint_keep;	 // number of checkpoint files kept
+	std::deque<std::string>	checkpoint_files; // written by this run, oldest first
+	RestartPoint	restart;
+
+	// probes, see writeProbes()
+	std::vector<nvect<Dim,quantity<position>>>	probe_points;
+	double										probe_dt;	// simulated time between samples, 0 for every step
+	std::ofstream								probe_file; // on the first process
 };
 
 template<size_t Dim>
 Simulation<Dim>::Simulation()
+:curve(NoCurve)
+,output_format(PerProcess)
+,hdf5_chunk(0)
+,hdf5_compression(0)
+,compression(NoCompression)
+,compression_level(-1)
+,compact_output(false)
+,num_owned(0)
+,check_migration(false)
+,place_tstep(0)
+,sort_interval(0)
+,sort_counter(0)
+,cell_changes(0)
+,use_neighbour_lists(false)
+,neighbours_valid(false)
+,skin(0.0)
+,pos_epoch(0)
+,cache_epoch(0)
+,cache_tstep(0)
+,cache_kernel(nullptr)
+,cache_distances(false)
+,fused_pipeline(false)
+,overlap_exchange(false)
+,exchange_in_flight(false)
+,full_exchange(false)
+,balance_interval(0)
+,balance_threshold(0.1)
+,balance_by_time(false)
+,balance_counter(0)
+,sum_time(0.0)
+,rebalancing(false)
+,adaptive_dt(false)
+,cfl_factor(0.25)
+,force_factor(0.25)
+,viscous_factor(0.125)
+,dt_min(1e-7)
+,dt_max(1e10)
+,dt_local(0.0)
+,dt_global(0.0)
+,dt_request(MPI_REQUEST_NULL)
+,dt_in_flight(false)
+,staged_count(0)
+,output_time(0.0)
+,checkpoint_interval(0)
+,checkpoint_keep(2)
+,probe_dt(0.0)
 {
 	// init MPI variables
 	comm_size = comm.size();
@@ -131,55 +470,46 @@ void Simulation<Dim>::init()
 {
 	using namespace std;
 
-	// get cell sizes in each dimension (can be slightly off 2h to ensure they fit exactly in the domain)
-	qvect<Dim,number> gnum_cells = gdomain.upper / (2.0_number*params.h);
+	// get cell sizes in each dimension (can be slightly off 2h to ensure they fit exactly in the domain),
+	// when using neighbour lists the cells must also cover the skin
+	qvect<Dim,number> gnum_cells = gdomain.upper / (2.0_number*params.h + skin);
 	for(size_t i=0;i<Dim;++i) gnum_cells[i] = floor(gnum_cells[i]);
-	qvect<Dim,length> cell_sizes = gdomain.upper / gnum_cells;
-	Extent<Dim> global_cell_counts = vect_cast<size_t>(utils::discard_dims(gnum_cells)); // "cast" to size_t
+	cell_sizes = gdomain.upper / gnum_cells;
+	global_cell_counts = vect_cast<size_t>(utils::discard_dims(gnum_cells)); // "cast" to size_t
 
 	if(!comm_rank) cout << "Cell sizes: " << cell_sizes/params.h << " * h" << endl;
 
-	// domain arrangements
-	domain_counts = calc_num_domains<Dim>(comm_size);
-	if(!comm_rank) cout << "Domain decomposition: " << domain_counts << endl;
-
-	// get our position amongst the domain_counts
-	domain_sub = idx_to_sub<Dim>((size_t)comm_rank,domain_counts);
+	stencil = getStencil();
 
-	// calculate the number of cells in the local domain
-	Extent<Dim> lnum_cells[comm_size];
-	for(size_t i=0;i<Dim;++i)
+	// a space filling curve replaces the grid of domains
+	if(curve!=NoCurve)
 	{
-		if(domain_sub[i]<(int)(domain_counts[i]-global_cell_counts[i]%domain_counts[i]))
-			lnum_cells[comm_rank][i] = floor(global_cell_counts[i]/domain_counts[i]);
-		else
-			lnum_cells[comm_rank][i] = floor(global_cell_counts[i]/domain_counts[i])+1;
+		initCurve();
+		colourCells();
+		return;
 	}
 
-	// broadcast our count to all other processes
-	boost::mpi::all_gather(comm,lnum_cells[comm_rank],lnum_cells);
+	// domain arrangements
+	domain_counts = calc_num_domains<Dim>(comm_size,global_cell_counts);
+	if(!comm_rank) cout << "Domain decomposition: " << domain_counts << ", halo/interior cells: " << halo_ratio<Dim>(domain_counts,global_cell_counts) << endl;
 
-	// get the size in each dimension of our domain
-	qvect<Dim,length> dom_sizes = vect_cast<number_t<>>(lnum_cells[comm_rank])*cell_sizes;
+	// get our position amongst the domain_counts
+	domain_sub = idx_to_sub<Dim>((size_t)comm_rank,domain_counts);
 
-	// calculate local domain physical position
+	// start by sharing the cells out evenly, any remainder going to the last domains
 	for(size_t i=0;i<Dim;++i)
-		for(size_t j=0;j<(size_t)domain_sub[i];++j)
+	{
+		cell_cuts[i].assign(domain_counts[i]+1,0);
+		for(size_t j=0;j<domain_counts[i];++j)
 		{
-			auto tmp = domain_sub;
-			tmp[i] = j;
-			ldomain.lower[i] += quantity<number>(lnum_cells[sub_to_idx<Dim>(tmp,domain_counts)][i])*cell_sizes[i];
+			size_t lnum_cells = global_cell_counts[i]/domain_counts[i];
+			if(j>=domain_counts[i]-global_cell_counts[i]%domain_counts[i])
+				++lnum_cells;
+			cell_cuts[i][j+1] = cell_cuts[i][j] + lnum_cells;
 		}
+	}
 
-	ldomain.upper = ldomain.lower + dom_sizes;
-
-	// TODO: should depend on padding of LCG
-	pdomain = ldomain;
-	pdomain.lower -= cell_sizes;
-	pdomain.upper += cell_sizes;
-
-	// initialize the linked cell grid.
-	cells.init(cell_sizes,lnum_cells[comm_rank],ldomain.lower);
+	applyDecomposition();
 
 	// initialize denstinations for mpi
 	for(size_t i=0;i<hc_elements(Dim);++i)
@@ -204,8 +534,316 @@ void Simulation<Dim>::init()
 		}
 	}
 
-	// store stencil for later
-	stencil = getStencil();
+	leaving.assign(hc_elements(Dim),std::vector<data_type>());
+	send_index.assign(hc_elements(Dim),std::vector<size_t>());
+	recv_offset.assign(hc_elements(Dim),0);
+	link_wraps.assign(hc_elements(Dim),make_vect<Dim,int>(0));
+	for(size_t i=0;i<hc_elements(Dim);++i)
+		for(size_t d=0;d<Dim;++d)
+		{
+			if(dest_periods[i][d]==PeriodDirec::Positive)
+				link_wraps[i][d] = -1;
+			else if(dest_periods[i][d]==PeriodDirec::Negative)
+				link_wraps[i][d] = +1;
+		}
+
+	// set up the persistent requests for exchanging ghosts and migrating particles,
+	// the latter on their own tags
+	std::vector<int> ranks(dest_ranks,dest_ranks+hc_elements(Dim));
+	std::vector<int> stags(send_tags,send_tags+hc_elements(Dim));
+	std::vector<int> rtags(recv_tags,recv_tags+hc_elements(Dim));
+	halo.setup(comm,ranks,stags,rtags);
+
+	for(size_t i=0;i<hc_elements(Dim);++i)
+	{
+		stags[i] |= 1<<9;
+		rtags[i] |= 1<<9;
+	}
+	migration.setup(comm,ranks,stags,rtags);
+
+	colourCells();
+}
+
+/**
+ * Sets the local domain extents and the linked cell grid from cell_cuts.
+ */
+template<size_t Dim>
+void Simulation<Dim>::applyDecomposition()
+{
+	Extent<Dim> lnum_cells;
+	for(size_t i=0;i<Dim;++i)
+		lnum_cells[i] = cell_cuts[i][domain_sub[i]+1]-cell_cuts[i][domain_sub[i]];
+
+	// get the size in each dimension of our domain
+	qvect<Dim,length> dom_sizes = vect_cast<number_t<>>(lnum_cells)*cell_sizes;
+
+	// calculate local domain physical position
+	ldomain.lower = make_vect<Dim,quantity<length>>(0.0);
+	for(size_t i=0;i<Dim;++i)
+		for(size_t j=0;j<(size_t)domain_sub[i];++j)
+			ldomain.lower[i] += quantity<number>(cell_cuts[i][j+1]-cell_cuts[i][j])*cell_sizes[i];
+
+	ldomain.upper = ldomain.lower + dom_sizes;
+
+	// TODO: should depend on padding of LCG
+	pdomain = ldomain;
+	pdomain.lower -= cell_sizes;
+	pdomain.upper += cell_sizes;
+
+	// initialize the linked cell grid.
+	cells.init(cell_sizes,lnum_cells,ldomain.lower);
+}
+
+/**
+ * Orders the global cells along the space filling curve and shares them out
+ * evenly, for when /sph/space_filling_curve is set. Unlike the grid of domains
+ * this works as well for any number of processes, at the cost of irregular
+ * domains with more neighbours.
+ */
+template<size_t Dim>
+void Simulation<Dim>::initCurve()
+{
+	size_t num_cells = 1, bits = 0;
+	for(size_t d=0;d<Dim;++d)
+	{
+		num_cells *= global_cell_counts[d];
+		while((size_t(1)<<bits)<global_cell_counts[d]) ++bits;
+	}
+
+	if(num_cells<comm_size)
+		throw runtime_error("Fewer cells than processes!");
+
+	// sort the cells by their position along the curve
+	std::vector<std::pair<size_t,size_t>> keys(num_cells);
+	for(size_t c=0;c<num_cells;++c)
+	{
+		Subscript<Dim> sub = idx_to_sub<Dim>(c,global_cell_counts);
+		keys[c].first = curve==Hilbert ? hilbert_index<Dim>(sub,bits) : morton_index<Dim>(sub,bits);
+		keys[c].second = c;
+	}
+	std::sort(keys.begin(),keys.end());
+
+	curve_order.resize(num_cells);
+	for(size_t k=0;k<num_cells;++k)
+		curve_order[k] = keys[k].second;
+
+	curve_cuts.resize(comm_size+1);
+	for(size_t r=0;r<=comm_size;++r)
+		curve_cuts[r] = r*num_cells/comm_size;
+
+	if(!comm_rank) cout << "Domain decomposition: " << (curve==Hilbert ? "Hilbert" : "Morton") << " curve through " << num_cells << " cells" << endl;
+
+	applyCurve();
+}
+
+/**
+ * Works out which cells each process owns from curve_cuts and sets up the
+ * local grid to cover the cells we own. Every distinct pair of a process owning
+ * a cell next to one of ours and the periods crossed to get to it is one
+ * neighbour for the halo exchanges, so the same process may be a neighbour
+ * more than once with a periodic domain. Every process must call this at the
+ * same time.
+ */
+template<size_t Dim>
+void Simulation<Dim>::applyCurve()
+{
+	cell_owner.resize(curve_order.size());
+	for(size_t r=0;r<comm_size;++r)
+		for(size_t k=curve_cuts[r];k<curve_cuts[r+1];++k)
+			cell_owner[curve_order[k]] = r;
+
+	// the local grid is the bounding box of our cells
+	Subscript<Dim> lo = vect_cast<int>(global_cell_counts);
+	Subscript<Dim> hi = make_vect<Dim,int>(0);
+	for(size_t k=curve_cuts[comm_rank];k<curve_cuts[comm_rank+1];++k)
+	{
+		Subscript<Dim> sub = idx_to_sub<Dim>(curve_order[k],global_cell_counts);
+		for(size_t d=0;d<Dim;++d)
+		{
+			lo[d] = std::min(lo[d],sub[d]);
+			hi[d] = std::max(hi[d],sub[d]+1);
+		}
+	}
+
+	grid_origin = lo;
+	Extent<Dim> lnum_cells = vect_cast<size_t>(hi-lo);
+
+	ldomain.lower = vect_cast<number_t<>>(lo)*cell_sizes;
+	ldomain.upper = ldomain.lower + vect_cast<number_t<>>(lnum_cells)*cell_sizes;
+
+	pdomain = ldomain;
+	pdomain.lower -= cell_sizes;
+	pdomain.upper += cell_sizes;
+
+	cells.init(cell_sizes,lnum_cells,ldomain.lower);
+
+	// find the neighbours and which of our cells each needs
+	link_index.clear();
+	send_cells.clear();
+	link_wraps.clear();
+	std::vector<int> ranks, stags, rtags;
+
+	Extent<Dim> wrap_counts = make_vect<Dim,size_t>(3);
+	for(size_t k=curve_cuts[comm_rank];k<curve_cuts[comm_rank+1];++k)
+	{
+		Subscript<Dim> sub = idx_to_sub<Dim>(curve_order[k],global_cell_counts);
+		size_t local = cells.subToIdx(sub-grid_origin);
+
+		utils::multi_for(make_vect<Dim,int>(-1),make_vect<Dim,int>(2),[&](const Subscript<Dim>& offset)->void{
+			Subscript<Dim> nbr = sub+offset;
+			Subscript<Dim> wrap;
+			for(size_t d=0;d<Dim;++d)
+			{
+				wrap[d] = nbr[d]<0 ? -1 : (nbr[d]>=(int)global_cell_counts[d] ? +1 : 0);
+				nbr[d] -= wrap[d]*(int)global_cell_counts[d];
+			}
+
+			int owner = cell_owner[sub_to_idx<Dim>(nbr,global_cell_counts)];
+			if(owner==(int)comm_rank && wrap==make_vect<Dim,int>(0))
+				return;
+
+			size_t key = linkKey(owner,wrap);
+			auto found = link_index.find(key);
+			if(found==link_index.end())
+			{
+				found = link_index.insert(std::make_pair(key,send_cells.size())).first;
+				send_cells.push_back(std::vector<size_t>());
+				link_wraps.push_back(wrap);
+
+				// the neighbour sees us across the opposite periods, which
+				// gives each message between a pair of processes its own tag
+				ranks.push_back(owner);
+				stags.push_back(sub_to_idx<Dim>(wrap+make_vect<Dim,int>(1),wrap_counts));
+				rtags.push_back(sub_to_idx<Dim>(make_vect<Dim,int>(1)-wrap,wrap_counts));
+			}
+
+			std::vector<size_t>& sends = send_cells[found->second];
+			if(sends.empty() || sends.back()!=local)
+				sends.push_back(local);
+		});
+	}
+
+	size_t num_links = send_cells.size();
+	leaving.assign(num_links,std::vector<data_type>());
+	send_index.assign(num_links,std::vector<size_t>());
+	recv_offset.assign(num_links,0);
+
+	halo.setup(comm,ranks,stags,rtags);
+
+	for(size_t i=0;i<num_links;++i)
+	{
+		stags[i] |= 1<<9;
+		rtags[i] |= 1<<9;
+	}
+	migration.setup(comm,ranks,stags,rtags);
+}
+
+/**
+ * Returns the index of the global cell holding pos. Positions outside the
+ * period are wrapped back into it, wrap is set to the number of periods this
+ * crossed in each dimension, which is at most one.
+ */
+template<size_t Dim>
+size_t Simulation<Dim>::globalCell(const nvect<Dim,quantity<position>>& pos, Subscript<Dim>& wrap) const
+{
+	Subscript<Dim> sub;
+	for(size_t d=0;d<Dim;++d)
+	{
+		int c = (int)floor(discard_dims(pos[d]/cell_sizes[d]));
+		int count = (int)global_cell_counts[d];
+		wrap[d] = c<0 ? -1 : (c>=count ? +1 : 0);
+		sub[d] = std::min(std::max(c-wrap[d]*count,0),count-1);
+	}
+	return sub_to_idx<Dim>(sub,global_cell_counts);
+}
+
+/**
+ * Identifies the neighbour owning the cells reached by crossing wrap periods,
+ * see applyCurve().
+ */
+template<size_t Dim>
+size_t Simulation<Dim>::linkKey(int rank, const Subscript<Dim>& wrap) const
+{
+	return rank*pow_int(3,Dim) + sub_to_idx<Dim>(wrap+make_vect<Dim,int>(1),make_vect<Dim,size_t>(3));
+}
+
+/**
+ * Whether a particle at pos belongs to us.
+ */
+template<size_t Dim>
+bool Simulation<Dim>::owns(const nvect<Dim,quantity<position>>& pos)
+{
+	if(curve==NoCurve)
+		return ldomain.inside(pos);
+
+	Subscript<Dim> wrap;
+	size_t cell = globalCell(pos,wrap);
+	return cell_owner[cell]==(int)comm_rank && wrap==make_vect<Dim,int>(0);
+}
+
+/**
+ * The process owning the cell holding pos, wrapped into the period.
+ */
+template<size_t Dim>
+int Simulation<Dim>::ownerOf(const nvect<Dim,quantity<position>>& pos) const
+{
+	Subscript<Dim> wrap;
+	size_t cell = globalCell(pos,wrap);
+	if(curve!=NoCurve)
+		return cell_owner[cell];
+
+	// find the slab holding the cell along each axis
+	Subscript<Dim> sub = idx_to_sub<Dim>(cell,global_cell_counts), owner;
+	for(size_t d=0;d<Dim;++d)
+		owner[d] = std::upper_bound(cell_cuts[d].begin(),cell_cuts[d].end(),(size_t)sub[d]) - cell_cuts[d].begin() - 1;
+	return sub_to_idx<Dim>(owner,domain_counts);
+}
+
+/**
+ * Sends every particle we own which belongs to another process straight to
+ * it, wrapping it into the period, however far away it is. This is collective
+ * and the ghosts and the linked cell grid are cleared.
+ */
+template<size_t Dim>
+void Simulation<Dim>::sendToOwners(size_t tstep)
+{
+	const auto& pos = particles.pos[tstep];
+
+	cells.clear();
+	particles.resize(num_owned);
+
+	std::vector<std::vector<data_type>> outgoing(comm_size), incoming;
+	Subscript<Dim> wrap;
+	size_t i = 0;
+	while(i<num_owned)
+	{
+		int owner = ownerOf(pos[i]);
+		globalCell(pos[i],wrap);
+		if(owner==(int)comm_rank && wrap==make_vect<Dim,int>(0))
+		{
+			++i;
+			continue;
+		}
+
+		data_type data;
+		particles.getData(i,data);
+		for(size_t d=0;d<Dim;++d)
+			for(size_t t=0;t<2;++t)
+				data.pos[t][d] -= wrap[d]*discard_dims(gdomain.upper[d]);
+
+		outgoing[owner].push_back(data);
+		particles.remove(i); // moves the last particle into i
+		--num_owned;
+	}
+
+	boost::mpi::all_to_all(comm,outgoing,incoming);
+
+	for(const std::vector<data_type>& from : incoming)
+		for(const data_type& data : from)
+		{
+			particles.push_back(data);
+			++num_owned;
+		}
 }
 
 template<size_t Dim>
@@ -243,6 +881,140 @@ void Simulation<Dim>::loadConfigXML(std::string fname)
 
 	get_option("/file_io/root",root,"out");
 
+	if(have_option("/file_io/format/mpi_io"))
+		output_format = SharedFile;
+	else if(have_option("/file_io/format/hdf5"))
+	{
+#ifdef SPH_HDF5
+		int chunk;
+		output_format = HDF5;
+		get_option("/file_io/format/hdf5/chunk_size",chunk,0);
+		get_option("/file_io/format/hdf5/compression",hdf5_compression,0);
+		if(chunk<0 || hdf5_compression<0 || hdf5_compression>9)
+		{
+			if(!comm_rank) cerr << "HDF5 chunk size must not be negative and the compression level must be between 0 and 9!" << endl;
+			throw runtime_error("Invalid HDF5 options!");
+		}
+		hdf5_chunk = chunk;
+		if(hdf5_compression && !hdf5_chunk)
+		{
+			if(!comm_rank) cerr << "HDF5 compression needs a chunk size." << endl;
+			throw runtime_error("HDF5 compression without chunking!");
+		}
+#else
+		if(!comm_rank) cerr << "Not compiled with HDF5, build with HDF5=1." << endl;
+		throw runtime_error("No HDF5 support!");
+#endif
+	}
+
+	if(have_option("/file_io/compression"))
+	{
+		if(have_option("/file_io/compression/zstd"))
+		{
+			compression = Zstd;
+			get_option("/file_io/compression/zstd/level",compression_level,-1);
+		}
+		else
+		{
+			compression = Gzip;
+			get_option("/file_io/compression/gzip/level",compression_level,-1);
+		}
+	}
+
+	if(have_option("/file_io/fields"))
+	{
+		get_option("/file_io/fields",tmps);
+		output_fields.select(tmps);
+		compact_output = true;
+	}
+
+	if(have_option("/file_io/time_level"))
+	{
+		int level;
+		get_option("/file_io/time_level",level);
+		if(level<0 || level>1)
+		{
+			if(!comm_rank) cerr << "The output time level must be 0 or 1!" << endl;
+			throw runtime_error("Invalid output time level!");
+		}
+		output_fields.time_level = level;
+		compact_output = true;
+	}
+
+	if(have_option("/file_io/quantisation"))
+	{
+		compact_output = true;
+		get_option("/file_io/quantisation/position",quantisation.position,0.0);
+		get_option("/file_io/quantisation/velocity",quantisation.velocity,0.0);
+		get_option("/file_io/quantisation/density",quantisation.density,0.0);
+		get_option("/file_io/quantisation/pressure",quantisation.pressure,0.0);
+		if(quantisation.position<0.0 || quantisation.velocity<0.0 || quantisation.density<0.0 || quantisation.pressure<0.0)
+		{
+			if(!comm_rank) cerr << "Quantisation error bounds must not be negative!" << endl;
+			throw runtime_error("Invalid quantisation error bound!");
+		}
+	}
+
+	if((compression!=NoCompression || compact_output) && output_format==SharedFile)
+	{
+		if(!comm_rank) cout << "Compression and field selection are not used for mpi_io files." << endl;
+	}
+
+	if(have_option("/file_io/asynchronous"))
+	{
+		int max_pending;
+		get_option("/file_io/asynchronous/max_pending",max_pending,2);
+		if(max_pending<1)
+		{
+			if(!comm_rank) cerr << "Asynchronous output needs at least one pending snapshot!" << endl;
+			throw runtime_error("Invalid number of pending snapshots!");
+		}
+
+		// collective writes have to be made by the main thread
+		if(output_format!=PerProcess)
+		{
+			if(!comm_rank) cout << "Asynchronous output is only used for per_process files, writing synchronously." << endl;
+		}
+		else
+		{
+			for(int i=0;i<max_pending;++i)
+				staging.emplace_back(new OutputState());
+			writer.start(max_pending);
+		}
+	}
+
+	if(have_option("/file_io/checkpoint"))
+	{
+		int interval, keep;
+		get_option("/file_io/checkpoint/interval",interval,100);
+		get_option("/file_io/checkpoint/keep",keep,2);
+		if(interval<1 || keep<1)
+		{
+			if(!comm_rank) cerr << "Checkpoint interval and number kept must be at least one!" << endl;
+			throw runtime_error("Invalid checkpoint options!");
+		}
+		checkpoint_interval = interval;
+		checkpoint_keep = keep;
+	}
+
+	if(have_option("/file_io/probes"))
+	{
+		get_option("/file_io/probes/dt",probe_dt,0.0);
+		if(probe_dt<0.0)
+		{
+			if(!comm_rank) cerr << "The time between probe samples can't be negative!" << endl;
+			throw runtime_error("Invalid probe interval!");
+		}
+
+		for(int i=0;i<option_count("/file_io/probes/point");++i)
+		{
+			stringstream sstr;
+			sstr << "/file_io/probes/point[" << i << "]";
+			get_option(sstr.str(),tmpvd);
+			probe_points.push_back(vector_to_nvect<Dim,quantity<position>>(tmpvd));
+		}
+	}
+
 	// load walls
 	if(have_option("/file_io/walls"))
 	{
@@ -266,14 +1038,14 @@ void Simulation<Dim>::loadConfigXML(std::string fname)
 		get_option(path+"/density",tmpd);
 		tmpf.density = quantity<density>(tmpd);
 
-		if(have_option(path+"viscosity/dynamic"))
+		if(have_option(path+"/viscosity/dynamic"))
 		{
-			get_option(path+"viscosity/dyanmic",tmpd);
+			get_option(path+"/viscosity/dynamic",tmpd);
 			tmpf.viscosity = quantity<viscosity>(tmpd);
 		}
 		else
 		{
-			get_option(path+"viscosity/kinematic",tmpd);
+			get_option(path+"/viscosity/kinematic",tmpd);
 			tmpf.viscosity = quantity<IntDim<0,2,-1>>(tmpd)*tmpf.density; // convert to dynamic viscosity
 		}
 
@@ -325,24 +1097,89 @@ void Simulation<Dim>::loadConfigXML(std::string fname)
 
 	params.V = pow<Dim>(params.dx);
 
-	// TODO: update for arbitrary dims
-	if(comm_rank==0)
-		cout << "Avg number of neighbours: " << floor(dims::pi*pow<2>(number_t<>(2.0)*params.h)/params.V) << endl;
-
-	if(comm_rank==0)
+	if(have_option("/sph/cell_sort"))
 	{
-		char dims[3] = {'x','y','z'};
-		for(size_t d=0;d<Dim;++d)
+		int interval;
+		get_option("/sph/cell_sort/interval",interval,1);
+		if(interval<1)
 		{
-			auto tmp = (gdomain.upper[d]/params.dx) - floor(gdomain.upper[d]/params.dx);
-			if( tmp > 0.01_number )
-			{
-				cout << "### Particle spacing does not match period length along the " << dims[d] << "-axis. ###" << endl;
-			}
+			if(!comm_rank) cerr << "Cell sort interval must be at least one!";
+			throw runtime_error("Invalid cell sort interval!");
 		}
+		sort_interval = interval;
+		cells.setSorted(true);
 	}
 
-	double time;
+	if(have_option("/sph/neighbour_list"))
+	{
+		double skin_factor;
+		get_option("/sph/neighbour_list/skin",skin_factor,0.2);
+		if(skin_factor<0.0)
+		{
+			if(!comm_rank) cerr << "Neighbour list skin must not be negative!";
+			throw runtime_error("Invalid neighbour list skin!");
+		}
+		skin = params.h*quantity<number>(skin_factor);
+		use_neighbour_lists = true;
+	}
+
+	if(have_option("/sph/threads"))
+	{
+		int threads;
+		get_option("/sph/threads",threads);
+		if(threads<1)
+		{
+			if(!comm_rank) cerr << "Number of threads must be at least one!";
+			throw runtime_error("Invalid number of threads!");
+		}
+#ifdef _OPENMP
+		scheduler.setThreads(threads);
+#else
+		if(!comm_rank && threads>1) cerr << "Not compiled with OpenMP, using a single thread." << endl;
+#endif
+	}
+
+	fused_pipeline = have_option("/sph/fused_pipeline");
+	overlap_exchange = have_option("/sph/overlap_exchange");
+	check_migration = have_option("/sph/migration_check");
+
+	if(have_option("/sph/space_filling_curve/hilbert"))
+		curve = Hilbert;
+	else if(have_option("/sph/space_filling_curve/morton"))
+		curve = Morton;
+
+	if(have_option("/sph/load_balance"))
+	{
+		int interval;
+		get_option("/sph/load_balance/interval",interval,10);
+		get_option("/sph/load_balance/threshold",balance_threshold,0.1);
+		if(interval<1 || balance_threshold<0.0)
+		{
+			if(!comm_rank) cerr << "Load balance interval must be at least one and the threshold not negative!";
+			throw runtime_error("Invalid load balance options!");
+		}
+		balance_interval = interval;
+		balance_by_time = have_option("/sph/load_balance/by_time");
+	}
+
+	// TODO: update for arbitrary dims
+	if(comm_rank==0)
+		cout << "Avg number of neighbours: " << floor(dims::pi*pow<2>(number_t<>(2.0)*params.h)/params.V) << endl;
+
+	if(comm_rank==0)
+	{
+		char dims[3] = {'x','y','z'};
+		for(size_t d=0;d<Dim;++d)
+		{
+			auto tmp = (gdomain.upper[d]/params.dx) - floor(gdomain.upper[d]/params.dx);
+			if( tmp > 0.01_number )
+			{
+				cout << "### Particle spacing does not match period length along the " << dims[d] << "-axis. ###" << endl;
+			}
+		}
+	}
+
+	double time;
 	get_option("/time/t_max",time);
 	params.tmax = quantity<dims::time>(time);
 	get_option("/time/dt_write",time);
@@ -350,9 +1187,44 @@ void Simulation<Dim>::loadConfigXML(std::string fname)
 	get_option("/time/dt_max",time);
 	params.dt = quantity<dims::time>(time);
 
+	if(have_option("/time/adaptive"))
+	{
+		adaptive_dt = true;
+		dt_max = time;
+		get_option("/time/dt_min",dt_min,1e-7);
+		get_option("/time/adaptive/cfl",cfl_factor,0.25);
+		get_option("/time/adaptive/force",force_factor,0.25);
+		get_option("/time/adaptive/viscous",viscous_factor,0.125);
+		if(cfl_factor<=0.0 || force_factor<=0.0 || viscous_factor<=0.0 || dt_min>dt_max)
+		{
+			if(!comm_rank) cerr << "Time step limit factors must be positive and dt_min no more than dt_max!" << endl;
+			throw runtime_error("Invalid adaptive time step options!");
+		}
+
+		// the first step is limited by the speed of sound and viscosity alone,
+		// nothing is moving yet
+		const double h = discard_dims(params.h);
+		for(const Fluid& fluid : fluids)
+		{
+			time = std::min(time,cfl_factor*h/discard_dims(fluid.speed_of_sound));
+			if(discard_dims(fluid.viscosity)>0.0)
+				time = std::min(time,viscous_factor*h*h*discard_dims(fluid.density/fluid.viscosity));
+		}
+		params.dt = quantity<dims::time>(std::max(time,dt_min));
+		if(!comm_rank) cout << "Adaptive time step, starting at " << discard_dims(params.dt) << " s" << endl;
+	}
+
 	// setup local domain_counts, linked cell grid, etc
 	init();
 
+	// carry on from a checkpoint rather than filling the domain
+	if(have_option("/file_io/restart"))
+	{
+		get_option("/file_io/restart",tmps);
+		loadCheckpoint(tmps);
+		return;
+	}
+
 	// perform any flood filling requested
 
 	for(int i=0;i<option_count("/flood_fill");++i)
@@ -515,9 +1387,10 @@ void Simulation<Dim>::assignParticleIds()
 	if(comm_rank>0)
 		comm.recv(comm_rank-1,comm_rank,gid);
 
-	for(auto& part : wall_particles)
+	for(size_t i=0;i<num_owned;++i)
 	{
-		part.id = gid;
+		if(particles.type[i]!=WallP) continue;
+		particles.id[i] = gid;
 		gid++;
 	}
 
@@ -534,11 +1407,12 @@ void Simulation<Dim>::assignParticleIds()
 	{
 		size_t nx = discard_dims(gdomain.upper[0]/params.dx);
 
-		for(auto& part : fluid_particles)
+		for(size_t p=0;p<num_owned;++p)
 		{
-			size_t i = discard_dims(part.pos[0][0]/params.dx);
-			size_t j = discard_dims(part.pos[0][1]/params.dx);
-			part.id = i+j*nx + gid;
+			if(particles.type[p]!=FluidP) continue;
+			size_t i = discard_dims(particles.pos[0][p][0]/params.dx);
+			size_t j = discard_dims(particles.pos[0][p][1]/params.dx);
+			particles.id[p] = i+j*nx + gid;
 		}
 	}
 	else
@@ -548,16 +1422,117 @@ void Simulation<Dim>::assignParticleIds()
 	}
 }
 
+/**
+ * Returns the particle store. Only the first ownedCount() particles belong to
+ * this process, any after those are ghosts.
+ */
+template<size_t Dim>
+const typename Simulation<Dim>::store_type& Simulation<Dim>::particleStore() const
+{
+	return particles;
+}
+
+template<size_t Dim>
+size_t Simulation<Dim>::ownedCount() const
+{
+	return num_owned;
+}
+
+/**
+ * Returns how many of our particles moved to a different cell since the
+ * previous call to placeParticlesIntoLinkedCellGrid().
+ */
+template<size_t Dim>
+size_t Simulation<Dim>::cellChanges() const
+{
+	return cell_changes;
+}
+
+/**
+ * Returns the scheduler used to share work between threads, which holds the
+ * time each thread has been busy and idle.
+ */
+template<size_t Dim>
+const TaskScheduler& Simulation<Dim>::taskScheduler() const
+{
+	return scheduler;
+}
+
+/**
+ * Whether the per-particle stages of each step should be folded into the
+ * passes either side of them, see updateNeighbours() and exchangeData().
+ */
+template<size_t Dim>
+bool Simulation<Dim>::fusedPipeline() const
+{
+	return fused_pipeline;
+}
+
+/**
+ * Whether exchanges of ghosts should be left in flight for the next doSPHSum()
+ * to finish, see beginExchangeData() and beginExchangeFull().
+ */
+template<size_t Dim>
+bool Simulation<Dim>::overlapExchange() const
+{
+	return overlap_exchange;
+}
+
+/**
+ * Whether the time step is worked out from the state of the particles after
+ * every step, see beginTimestepReduction().
+ */
+template<size_t Dim>
+bool Simulation<Dim>::adaptiveTimestep() const
+{
+	return adaptive_dt;
+}
+
+/**
+ * Seconds the time stepping has been held up by writeOutput() and
+ * finishOutput(), either writing or waiting for the background writer.
+ */
+template<size_t Dim>
+double Simulation<Dim>::outputTime() const
+{
+	return output_time;
+}
+
+/**
+ * Steps between checkpoints, zero if none are written.
+ */
+template<size_t Dim>
+size_t Simulation<Dim>::checkpointInterval() const
+{
+	return checkpoint_interval;
+}
+
+/**
+ * The number of points the fluid is sampled at by writeProbes().
+ */
+template<size_t Dim>
+size_t Simulation<Dim>::probeCount() const
+{
+	return probe_points.size();
+}
+
+/**
+ * Simulated time between probe samples, zero for every step.
+ */
 template<size_t Dim>
-const MainList<typename Simulation<Dim>::particle_type >& Simulation<Dim>::fluidParticles() const
+double Simulation<Dim>::probeInterval() const
 {
-	return fluid_particles;
+	return probe_dt;
 }
 
+/**
+ * Where the time stepping should carry on from if the particles were loaded
+ * from a checkpoint, see loadCheckpoint().
+ */
 template<size_t Dim>
-const MainList<typename Simulation<Dim>::particle_type >& Simulation<Dim>::wallParticles() const
+const typename Simulation<Dim>::RestartPoint& Simulation<Dim>::restartPoint() const
 {
-	return wall_particles;
+	return restart;
 }
 
 template<size_t Dim> template<typename Archive>
@@ -567,186 +1542,1354 @@ void Simulation<Dim>::serialize(Archive& a, const unsigned int version)
 	a & gdomain;
 	a & ldomain;
 	a & fluids;
-	a & fluid_particles;
-	a & wall_particles;
+	a & particles.head(num_owned); // not the ghosts
 }
 
 //BOOST_CLASS_VERSION(Simulation<2>,0)
 //BOOST_CLASS_VERSION(Simulation<3>,0)
 
+template<size_t Dim> template<typename Archive>
+void Simulation<Dim>::OutputState::serialize(Archive& a, const unsigned int version)
+{
+	a & params;
+	a & gdomain;
+	a & ldomain;
+	a & fluids;
+	a & particles.head(num_owned);
+}
+
 template<size_t Dim>
 void Simulation<Dim>::writeOutput(size_t file_number)
 {
-	// TODO: use boost::iostreams to compress output
-	using namespace std;
-	stringstream fname_str;
-	fname_str << root << '.' << file_number << '.' << comm_rank << ".dat";
+	auto output_start = std::chrono::steady_clock::now(); // for outputTime()
+
+	if(output_format==SharedFile)
+		writeSharedFile(file_number);
+	else if(output_format==HDF5)
+		writeHDF5(file_number);
+	else if(writer.running())
+		writeAsync(file_number);
+	else
+		writeArchive(archiveName(file_number),*this);
+
+	output_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-output_start).count();
+}
+
+template<size_t Dim> template<typename Archive>
+void Simulation<Dim>::CompactState::serialize(Archive& a, const unsigned int version)
+{
+	a & params;
+	a & gdomain;
+	a & ldomain;
+	a & fluids;
+	a & particles;
+}
 
-	ofstream fout(fname_str.str(),ios::binary);
-	if(!fout.is_open())
+/**
+ * The name of this process's file for the snapshot, root.N.rank.dat or
+ * root.N.rank.cdat if compact, with a suffix for the compression.
+ */
+template<size_t Dim>
+std::string Simulation<Dim>::archiveName(size_t file_number) const
+{
+	std::stringstream fname_str;
+	fname_str << root << '.' << file_number << '.' << comm_rank << (compact_output ? ".cdat" : ".dat") << compression_suffix(compression);
+	return fname_str.str();
+}
+
+/**
+ * Writes the per process file from state, which is either this simulation or
+ * a copy of it. A compact file holds a CompactState made from it instead.
+ * This only reads settings fixed by loadConfigXML() so it may be called by the
+ * background writer.
+ */
+template<size_t Dim> template<class State>
+void Simulation<Dim>::writeArchive(const std::string& fname, const State& state) const
+{
+	bool opened;
+	if(compact_output)
 	{
-		cerr << "Error opening output file on proc " << comm_rank << endl;
+		CompactState out;
+		out.params = state.params;
+		out.gdomain = state.gdomain;
+		out.ldomain = state.ldomain;
+		out.fluids = state.fluids;
+		out.particles.assign(state.particles,state.num_owned,output_fields,quantisation);
+		opened = write_archive(fname,out,compression,compression_level);
 	}
+	else
+		opened = write_archive(fname,state,compression,compression_level);
 
-	boost::archive::binary_oarchive oarch(fout);
-	oarch << *this;
+	if(!opened)
+		std::cerr << "Error opening output file on proc " << comm_rank << std::endl;
+}
 
-	fout.close();
+/**
+ * Copies what would be written by writeArchive() into the next staging
+ * buffer and leaves the background writer to write it, the file is the same
+ * as one written by writeOutput() directly. This only blocks if the writer is
+ * already the maximum number of snapshots behind.
+ */
+template<size_t Dim>
+void Simulation<Dim>::writeAsync(size_t file_number)
+{
+	// the buffer used maxPending() snapshots ago is free once there is a slot
+	writer.waitForSlot();
+	OutputState* state = staging[staged_count++ % staging.size()].get();
+
+	state->params = params;
+	state->gdomain = gdomain;
+	state->ldomain = ldomain;
+	state->fluids = fluids;
+	state->num_owned = num_owned;
+	state->particles = particles;
+
+	std::string fname = archiveName(file_number);
+	writer.submit([this,state,fname]()
+	{
+		writeArchive(fname,*state);
+	});
 }
 
+/**
+ * Waits for the background writer to finish any snapshots it has been given,
+ * this must be called before the end of the simulation.
+ */
 template<size_t Dim>
-const Parameters<Dim>& Simulation<Dim>::parameters() const
+void Simulation<Dim>::finishOutput()
 {
-	return params;
+	if(!writer.running()) return;
+
+	auto output_start = std::chrono::steady_clock::now();
+	writer.finish();
+	output_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-output_start).count();
 }
 
+/**
+ * Writes the particles we own into a single file, root.N.snap, shared by all
+ * processes, see SnapshotFile.hpp for the layout. This must be called by every
+ * process at the same time.
+ */
 template<size_t Dim>
-const vector<Fluid>& Simulation<Dim>::fluidPhases() const
+void Simulation<Dim>::writeSharedFile(size_t file_number)
 {
-	return fluids;
+	std::stringstream fname_str;
+	fname_str << root << '.' << file_number << ".snap";
+
+	std::vector<data_type> records(num_owned);
+	for(size_t i=0;i<num_owned;++i)
+		particles.getData(i,records[i]);
+
+	write_snapshot(comm,fname_str.str(),snapshotHeader(file_number),particle_fields<Dim,2,2>(),records.data(),num_owned);
 }
 
 /**
- * Swap particles which have moved out of our local domain so that
- * they reside on the correct processor and then delete them from this
- * processor. This is based on the position at tstep=0
+ * The header of a shared file snapshot, without the time stepping state.
  */
 template<size_t Dim>
-void Simulation<Dim>::exchangeOutOfBounds(size_t tstep)
+SnapshotHeader Simulation<Dim>::snapshotHeader(size_t file_number) const
 {
-	/*
-	 * Note: the current method is pretty brute force, it involves sending all out of bounds particles
-	 * to all processors then letting the receiving procs deal with them!
-	 *
-	 * First get all the fluid particles which are outside the domain then put them in the list to_transfer
-	 */
+	SnapshotHeader header;
+	std::memset(&header,0,sizeof(header));
+	header.dim = Dim;
+	header.file_number = file_number;
+	header.record_size = sizeof(data_type);
+	for(size_t d=0;d<Dim;++d)
+		header.period[d] = discard_dims(gdomain.upper[d]);
+	header.h = discard_dims(params.h);
+	header.dx = discard_dims(params.dx);
+	header.dt = discard_dims(params.dt);
+	return header;
+}
 
-	cells.clear(); // unhook everything from sublists
+/**
+ * Writes a checkpoint, root.step.chk, holding the full state of every particle
+ * and where the time stepping has got to, so that the simulation can be
+ * restarted from it on any number of processes. step is the number of steps
+ * taken, time the simulated time after them and file_number that of the next
+ * output. It is meant to be called every checkpointInterval() steps and only
+ * the latest few checkpoints written by this run are kept. This must be called
+ * by every process at the same time.
+ *
+ * The checkpoint is a shared file snapshot, written with one collective
+ * MPI-IO call whatever the output format.
+ */
+template<size_t Dim>
+void Simulation<Dim>::writeCheckpoint(size_t step, double time, size_t file_number)
+{
+	auto output_start = std::chrono::steady_clock::now(); // for outputTime()
+
+	finishExchange();
+
+	std::stringstream fname_str;
+	fname_str << root << '.' << step << ".chk";
+
+	std::vector<data_type> records(num_owned);
+	for(size_t i=0;i<num_owned;++i)
+		particles.getData(i,records[i]);
+
+	SnapshotHeader header = snapshotHeader(file_number);
+	header.time = time;
+	header.step = step;
+
+	write_snapshot(comm,fname_str.str(),header,particle_fields<Dim,2,2>(),records.data(),num_owned);
+
+	// remove the oldest ones beyond those kept, by name as the steps they were
+	// written at depend on where a restart began and the interval it used
+	checkpoint_files.push_back(fname_str.str());
+	while(checkpoint_files.size()>checkpoint_keep)
+	{
+		if(!comm_rank)
+			std::remove(checkpoint_files.front().c_str());
+		checkpoint_files.pop_front();
+	}
+
+	if(!comm_rank) cout << "Checkpoint written to " << fname_str.str() << endl;
 
-	std::vector<plist_type> to_transfer;
-	to_transfer.resize(comm_size);
+	output_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-output_start).count();
+}
+
+/**
+ * Samples the fluid at each probe point, interpolating the pressure, density
+ * and velocity of the nearby fluid particles with the kernel K, normalised by
+ * the sum of the weights. The first process appends a line to root.probes
+ * holding time then the values at each point in turn, or nan at a point with
+ * no fluid near it. This must be called by every process at the same time.
+ */
+template<size_t Dim> template<template<int> class K>
+void Simulation<Dim>::writeProbes(double time)
+{
+	// weight, pressure, density then velocity for each probe
+	const size_t cols = 3+Dim;
+	std::vector<double> local(probe_points.size()*cols,0.0), global(local.size());
 
-	auto itr = fluid_particles.begin();
-	while(itr!=fluid_particles.end())
+	const double h = discard_dims(params.h);
+	for(size_t p=0;p<probe_points.size();++p)
 	{
-		if(!ldomain.inside(itr->pos[tstep]))
+		double* sample = &local[p*cols];
+		for(size_t i=0;i<num_owned;++i)
 		{
-			to_transfer[comm_rank].push_back(*itr);
-			itr = fluid_particles.erase(itr);
+			if(particles.type[i]!=FluidP) continue;
+
+			// the nearest periodic image of the particle
+			double r2 = 0.0;
+			for(size_t d=0;d<Dim;++d)
+			{
+				double period = discard_dims(gdomain.upper[d]);
+				double dx = discard_dims(particles.pos[0][i][d]-probe_points[p][d]);
+				dx -= period*std::round(dx/period);
+				r2 += dx*dx;
+			}
+			if(r2>=4.0*h*h) continue;
+
+			double w = discard_dims(K<Dim>::Kernel(quantity<length>(std::sqrt(r2)),params.h));
+			sample[0] += w;
+			sample[1] += w*discard_dims(particles.pressure[i]);
+			sample[2] += w*discard_dims(particles.density[0][i]);
+			for(size_t d=0;d<Dim;++d)
+				sample[3+d] += w*discard_dims(particles.vel[0][i][d]);
 		}
-		else
-			++itr;
 	}
 
-	/*
-	 * Then send the list to_transfer to all other processors while receiving their lists.
-	 */
-	for(size_t proc=0; proc<comm_size;++proc)
+	boost::mpi::reduce(comm,local.data(),(int)local.size(),global.data(),std::plus<double>(),0);
+	if(comm_rank) return;
+
+	if(!probe_file.is_open())
 	{
-		comm.barrier(); // is this necessary?
-		boost::mpi::broadcast(comm,to_transfer[proc],proc);
+		// a restarted simulation carries on with the samples taken before
+		probe_file.open(root+".probes",restart.restarted ? std::ios::app : std::ios::trunc);
+		if(!probe_file)
+			throw runtime_error("Unable to open probe file: "+root+".probes");
+		probe_file.precision(12);
 
-		if(proc!=comm_rank)
+		if(probe_file.tellp()==0)
 		{
-			for(auto& part : to_transfer[proc])
+			for(size_t p=0;p<probe_points.size();++p)
 			{
-				// if the particle is in our domain keep it
-				if(ldomain.inside(part.pos[tstep]))
-					fluid_particles.push_back(part);
+				probe_file << "# probe " << p << " at";
+				for(size_t d=0;d<Dim;++d)
+					probe_file << ' ' << discard_dims(probe_points[p][d]);
+				probe_file << '\n';
 			}
+			probe_file << "# time, then pressure, density and velocity at each probe" << '\n';
 		}
 	}
+
+	probe_file << time;
+	for(size_t p=0;p<probe_points.size();++p)
+	{
+		const double* sample = &global[p*cols];
+		for(size_t c=1;c<cols;++c)
+			probe_file << ' ' << (sample[0]>0.0 ? sample[c]/sample[0] : std::numeric_limits<double>::quiet_NaN());
+	}
+	probe_file << std::endl;
 }
 
 /**
- * This function puts wall_particles and fluid_particles into the correct sublists based
- * upon their positions at the specified timestep.
+ * Replaces the flood filling of the domain with the particles from a
+ * checkpoint written by writeCheckpoint(), possibly on a different number of
+ * processes or with a different decomposition. The particles are read in
+ * even shares then sent to their owners. The time step is taken from the
+ * checkpoint, the rest of the parameters come from the config and must give
+ * the same resolution and domain.
  */
 template<size_t Dim>
-void Simulation<Dim>::placeParticlesIntoLinkedCellGrid(size_t tstep)
+void Simulation<Dim>::loadCheckpoint(const std::string& fname)
 {
-	cells.clear();
+	SnapshotHeader header;
+	std::vector<SnapshotField> fields;
+	std::vector<char> records;
+	read_snapshot(comm,fname,header,fields,records);
+
+	// the records must be laid out as ours are
+	std::vector<SnapshotField> expected = particle_fields<Dim,2,2>();
+	bool same_layout = header.dim==Dim && header.record_size==sizeof(data_type) && fields.size()==expected.size();
+	for(size_t f=0;same_layout && f<fields.size();++f)
+		same_layout = std::strncmp(fields[f].name,expected[f].name,sizeof(fields[f].name))==0
+					  && fields[f].type==expected[f].type
+					  && fields[f].components==expected[f].components
+					  && fields[f].offset==expected[f].offset;
+	if(!same_layout)
+		throw runtime_error("Checkpoint "+fname+" was written by an incompatible build!");
+
+	auto differs = [](double a, double b) { return std::abs(a-b)>1e-12*std::max(std::abs(a),std::abs(b)); };
+	bool same_domain = !differs(header.h,discard_dims(params.h)) && !differs(header.dx,discard_dims(params.dx));
+	for(size_t d=0;d<Dim;++d)
+		same_domain = same_domain && !differs(header.period[d],discard_dims(gdomain.upper[d]));
+	if(!same_domain)
+		throw runtime_error("Checkpoint "+fname+" has a different resolution or domain from the config!");
+
+	params.dt = quantity<dims::time>(header.dt);
+
+	restart.restarted = true;
+	restart.time = header.time;
+	restart.step = header.step;
+	restart.file_number = header.file_number;
+
+	particles.clear();
+	num_owned = 0;
+	size_t n = records.size()/sizeof(data_type);
+	particles.reserve(n);
+	for(size_t i=0;i<n;++i)
+	{
+		data_type data;
+		std::memcpy(&data,&records[i*sizeof(data_type)],sizeof(data_type));
+		particles.push_back(data);
+		++num_owned;
+	}
 
-	cells.place(fluid_particles,tstep);
-	cells.place(wall_particles, tstep);
+	sendToOwners(0);
+
+	if(!comm_rank) cout << "Restarted from " << fname << " at t = " << restart.time << " after " << restart.step << " steps, " << header.num_particles << " particles" << endl;
 }
 
 /**
- * This function is used to actually perform the SPH sums over fluid & wall
- * particles. It accepts any callable objects of the form
+ * Writes the particles we own as one HDF5 dataset per field with an XDMF
+ * description, see HDF5File.hpp. This must be called by every process at the
+ * same time.
+ */
+template<size_t Dim>
+void Simulation<Dim>::writeHDF5(size_t file_number)
+{
+#ifdef SPH_HDF5
+	std::stringstream fname_str;
+	fname_str << root << '.' << file_number;
+
+	HDF5Options opts;
+	opts.chunk = hdf5_chunk;
+	opts.compression = hdf5_compression;
+
+	write_hdf5(comm,fname_str.str(),particles,num_owned,output_fields,opts);
+#endif
+}
+
+template<size_t Dim>
+const Parameters<Dim>& Simulation<Dim>::parameters() const
+{
+	return params;
+}
+
+template<size_t Dim>
+const vector<Fluid>& Simulation<Dim>::fluidPhases() const
+{
+	return fluids;
+}
+
+/**
+ * Swap particles which have moved out of our local domain so that
+ * they reside on the correct processor and then delete them from this
+ * processor. This is based on the position at tstep=0
  *
- * void func(particle_type& a, particle_type& b, quantity<IntDim<0,-Dim,0>> W_ab, quantity<IntDim<0,-Dim-1,0>> gradW_ab)
+ * Each particle which has left is sent to the neighbouring process in the
+ * direction it left, being wrapped around the period if it crosses it, so a
+ * particle may only move into a neighbouring domain between calls. One which
+ * moves further is passed on at the next call, or an exception is thrown if
+ * /sph/migration_check is set. With a space filling curve a particle may only
+ * move into a cell next to one of ours.
  *
- * Note; if a value is returned it is discarded.
+ * Any functions given are applied to each particle we own, as applyFunctions()
+ * would, just before it is checked.
+ *
+ * While balanceLoad() is moving the domains wall particles are sent too.
  */
-template<size_t Dim>
-template<template<int> class Kernel, typename... Fs>
-void Simulation<Dim>::doSPHSum(size_t tstep, Fs&&... fs)
+template<size_t Dim> template<typename... Fs>
+void Simulation<Dim>::exchangeOutOfBounds(size_t tstep, Fs&&... fs)
 {
-	static_assert(sizeof...(Fs)>0,"No operations passed to doSPHSum()!");
+	finishExchange();
 
-	auto itr = fluid_particles.begin();
-	while(true)
-	{
-		// safety check
-		if(!ldomain.inside(itr->pos[tstep]))
-		{
-			throw ParticleException<particle_type>(*itr,"Particle out of domain");
-		}
+	cells.clear(); // unhook everything from sublists
+	particles.resize(num_owned); // ghosts are stale after moving
+	neighbours_valid = false; // particle indices are about to change
+	++pos_epoch;
 
-		Subscript<Dim> x_sub = cells.posToSub(itr->pos[tstep]);
+	for(std::vector<data_type>& to : leaving)
+		to.clear();
 
-		// iterate over nearby particles
-		for(Subscript<Dim>& dcell : stencil)
+	/*
+	 * First sort the fluid particles which are outside the domain by the
+	 * neighbour they have moved towards
+	 */
+
+	size_t i = 0;
+	while(i<num_owned)
+	{
+		applyToParticle(i,fs...); // a removed particle is replaced by one not yet seen
+
+		// walls stay put so only move when the domains do
+		if((particles.type[i]==FluidP || rebalancing) && !owns(particles.pos[tstep][i]))
 		{
-			typename LCGList<particle_type>::iterator sub_itr;
+			const nvect<Dim,quantity<position>>& pos = particles.pos[tstep][i];
+
+			// find the neighbour to send it to and the periods it crossed
+			size_t n;
+			Subscript<Dim> wrap;
 
-			if(dcell==make_vect<Dim,int>(0))
+			if(curve!=NoCurve)
 			{
-				sub_itr = cells.getCell(cells.subToIdx(x_sub)).iterator_to(*itr);
+				size_t cell = globalCell(pos,wrap);
+				auto found = link_index.find(linkKey(cell_owner[cell],wrap));
+				if(found==link_index.end())
+					throw ParticleException<particle_type>(particles.get(i),"Particle moved more than one cell");
+				n = found->second;
 			}
 			else
 			{
-				sub_itr = cells.getCell(cells.subToIdx(x_sub+dcell)).begin();
-			}
+				Subscript<Dim> direc;
+				for(size_t d=0;d<Dim;++d)
+					direc[d] = pos[d]<ldomain.lower[d] ? -1 : (pos[d]>ldomain.upper[d] ? +1 : 0);
 
-			auto sub_end = cells.getCell(cells.subToIdx(x_sub+dcell)).end();
-			while(sub_itr!=sub_end)
-			{
-				qvect<Dim,length>	r_ab = (itr->pos[tstep]-sub_itr->pos[tstep]);
-				quantity<length>	dist_ab = r_ab.magnitude();
+				n = std::find(shifts,shifts+hc_elements(Dim),direc)-shifts;
 
-				// skip if more than 2h away
-				if(dist_ab>=2.0_number*params.h)
+				// not outside any face, e.g. a NaN position from an unstable run
+				if(n==hc_elements(Dim))
+					throw ParticleException<particle_type>(particles.get(i),"Particle moved more than one domain");
+
+				// this is needed even with a single domain in a dimension so
+				// dest_periods can't be used
+				for(size_t d=0;d<Dim;++d)
 				{
-					++sub_itr;
-					continue;
+					if(direc[d]==-1 && domain_sub[d]==0)
+						wrap[d] = -1;
+					else if(direc[d]==+1 && domain_sub[d]==(int)domain_counts[d]-1)
+						wrap[d] = +1;
+					else
+						wrap[d] = 0;
 				}
+			}
 
-				qvect<Dim,number>				unit_ab = r_ab/dist_ab;
-				quantity<IntDim<0,-(int)Dim,0>>    W_ab = Kernel<Dim>::Kernel(dist_ab,params.h);
-				quantity<IntDim<0,-1-(int)Dim,0>> dW_ab = Kernel<Dim>::Grad(dist_ab,params.h);
+			data_type data;
+			particles.getData(i,data);
 
-				// for explanation of this line see: http://stackoverflow.com/questions/18077259/variadic-function-accepting-functors-callable-objects
-				auto dummylist = {
-						((void)std::forward<Fs>(fs)(*itr,*sub_itr,kernels::ParticleDelta<Dim>{dist_ab,unit_ab,W_ab,dW_ab},*this),0)...
-					};
-				(void)dummylist; // stop the compiler warning about unused variable
+			// wrap around the period
+			for(size_t d=0;d<Dim;++d)
+			{
+				double shift = -wrap[d]*discard_dims(gdomain.upper[d]);
 
-				++sub_itr;
+				for(size_t t=0;t<2;++t)
+					data.pos[t][d] += shift;
 			}
+
+			leaving[n].push_back(data);
+			particles.remove(i); // moves the last particle into i
+			--num_owned;
 		}
+		else
+			++i;
+	}
 
-		++itr;
+	/*
+	 * Then swap them with the neighbours
+	 */
 
-		if(itr==fluid_particles.end())
-			itr = wall_particles.begin();
+	for(size_t n=0;n<leaving.size();++n)
+		std::copy(leaving[n].begin(),leaving[n].end(),migration.sendBuffer(n,leaving[n].size()));
 
-		if(itr==wall_particles.end())
-			break;
+	migration.start();
+	migration.wait();
+
+	for(size_t n=0;n<leaving.size();++n)
+	{
+		const data_type* buf = migration.recvBuffer(n);
+		for(size_t k=0;k<migration.recvCount(n);++k)
+		{
+			particles.push_back(buf[k]);
+			++num_owned;
+
+			// it should be ours unless it jumped more than one domain
+			if(check_migration && !rebalancing && !owns(particles.pos[tstep][num_owned-1]))
+				throw ParticleException<particle_type>(particles.get(num_owned-1),"Particle moved more than one domain");
+		}
 	}
 }
 
+/**
+ * Moves the ghosts just received from neighbour i across the period, if they
+ * came from the other side of a periodic boundary.
+ */
+template<size_t Dim>
+void Simulation<Dim>::shiftReceived(size_t i)
+{
+	data_type* buf = halo.recvBuffer(i);
+
+	for(size_t d=0;d<Dim;++d)
+	{
+		if(!link_wraps[i][d])
+			continue;
+
+		double shift = link_wraps[i][d]*discard_dims(gdomain.upper[d]);
+
+		for(size_t k=0;k<halo.recvCount(i);++k)
+			for(size_t t=0;t<2;++t)
+				buf[k].pos[t][d] += shift;
+	}
+}
+
+/**
+ * This function puts the wall and fluid particles we own into the correct cells based
+ * upon their positions at the specified timestep.
+ */
+template<size_t Dim>
+void Simulation<Dim>::placeParticlesIntoLinkedCellGrid(size_t tstep)
+{
+	cells.clear();
+	particles.resize(num_owned); // drop any ghosts, exchangeFull() will replace them
+	neighbours_valid = false;
+	++pos_epoch;
+
+	// reorder the particles by cell at the start of every sort_interval-th step
+	// so that neighbours are close together in memory
+	if(sort_interval && tstep==0 && (sort_counter++ % sort_interval)==0)
+		cells.sort(particles,tstep,0,num_owned);
+
+	cell_changes = cells.place(particles,tstep,0,num_owned,scheduler);
+	place_tstep = tstep;
+}
+
+/**
+ * Builds the verlet neighbour lists from the linked cell grid, this must be
+ * called after exchangeFull(). Each list holds the particles within 2h+skin so
+ * it stays complete until some particle has moved more than skin/2.
+ */
+template<size_t Dim>
+void Simulation<Dim>::buildNeighbourLists(size_t tstep)
+{
+	const auto& pos = particles.pos[tstep];
+	const double cutoff2 = discard_dims(pow<2>(2.0_number*params.h + skin));
+
+	if(cells.sorted())
+		cells.buildTable();
+
+	nbr_start.assign(num_owned+1,0);
+	nbr_ghosts.assign(num_owned,0);
+	nbr_list.clear();
+
+	for(size_t a=0;a<num_owned;++a)
+	{
+		forEachCandidate(a,cells.posToSub(pos[a]),[&](size_t b)
+		{
+			if(square_magnitude(pos[a]-pos[b])<cutoff2)
+			{
+				nbr_list.push_back(b);
+				nbr_ghosts[a] |= b>=num_owned;
+			}
+		});
+
+		nbr_start[a+1] = nbr_list.size();
+	}
+
+	build_pos.assign(pos.begin(),pos.begin()+num_owned);
+	neighbours_valid = true;
+}
+
+/**
+ * Brings the particles and their neighbours up to date with the positions at
+ * the specified timestep. Particles which have left the local domain are moved
+ * to the correct processor, placed into the linked cell grid and exchanged with
+ * neighbouring processes. When neighbour lists are enabled this is only done
+ * once a particle has moved more than half the skin since the lists were built,
+ * until then the ghosts are just updated in place with exchangeData().
+ *
+ * Any functions given are applied to the particles we own first, as
+ * applyFunctions() would, but within the pass which looks for moved particles
+ * rather than in a pass of their own.
+ */
+template<size_t Dim> template<typename... Fs>
+void Simulation<Dim>::updateNeighbours(size_t tstep, Fs&&... fs)
+{
+	bool applied = false;
+
+	if(neighbours_valid)
+	{
+		// find the largest distance any particle has moved since the lists were built
+		const auto& pos = particles.pos[tstep];
+		std::vector<double> thread_max(scheduler.threads(),0.0);
+		scheduler.parallelFor(0,num_owned,[&](size_t i, size_t thread)
+		{
+			applyToParticle(i,fs...);
+			thread_max[thread] = std::max(thread_max[thread],discard_dims((pos[i]-build_pos[i]).magnitude()));
+		});
+		applied = true;
+
+		double max_disp = *std::max_element(thread_max.begin(),thread_max.end());
+		double global_max_disp;
+		boost::mpi::all_reduce(comm,max_disp,global_max_disp,boost::mpi::maximum<double>());
+
+		if(2.0*global_max_disp<discard_dims(skin))
+		{
+			// the next sum can start on the particles away from the ghosts
+			if(overlap_exchange)
+				beginExchangeData();
+			else
+				exchangeData();
+			++pos_epoch; // the ghosts have moved
+			return;
+		}
+	}
+
+	if(applied)
+		exchangeOutOfBounds(tstep);
+	else
+		exchangeOutOfBounds(tstep,fs...);
+	placeParticlesIntoLinkedCellGrid(tstep);
+
+	// the lists need the ghosts, without them the next sum waits for them
+	if(use_neighbour_lists)
+	{
+		exchangeFull();
+		buildNeighbourLists(tstep);
+	}
+	else if(overlap_exchange)
+		beginExchangeFull();
+	else
+		exchangeFull();
+}
+
+/**
+ * Checks the load balance every balance_interval-th call and, if the busiest
+ * process is more than balance_threshold above the mean, moves the cuts
+ * between the domains so that each slab along each axis holds an equal share
+ * of the load. The load is the number of particles we own, or the time spent
+ * in doSPHSum() when /sph/load_balance/by_time is set, in which case it is
+ * spread evenly over our particles.
+ *
+ * The domains stay a Cartesian grid of slabs of whole cells so each process
+ * keeps the same neighbours and halo plans, only the positions of the cuts
+ * change. With a space filling curve the curve is cut into segments of equal
+ * load instead, see balanceCurve(). Particles are migrated to their new domains before returning and
+ * the next updateNeighbours() rebuilds the cells and ghosts. Returns whether
+ * the domains were changed.
+ */
+template<size_t Dim>
+bool Simulation<Dim>::balanceLoad(size_t tstep)
+{
+	if(!balance_interval || (++balance_counter % balance_interval)!=0)
+		return false;
+
+	double load = balance_by_time ? sum_time : (double)num_owned;
+	sum_time = 0.0;
+
+	double max_load, total_load;
+	boost::mpi::all_reduce(comm,load,max_load,boost::mpi::maximum<double>());
+	boost::mpi::all_reduce(comm,load,total_load,std::plus<double>());
+
+	double imbalance = total_load>0.0 ? max_load/(total_load/comm_size) - 1.0 : 0.0;
+	if(imbalance<=balance_threshold)
+		return false;
+
+	finishExchange();
+
+	double weight = num_owned ? load/num_owned : 0.0;
+	if(curve!=NoCurve)
+		balanceCurve(tstep,weight);
+	else
+		balanceSlabs(tstep,weight);
+
+	// have the next updateNeighbours() rebuild the cells, ghosts and lists
+	cells.clear();
+	particles.resize(num_owned);
+	neighbours_valid = false;
+	++pos_epoch;
+
+	if(!comm_rank) cout << "Load imbalance " << imbalance << ", rebalanced the domains" << endl;
+
+	return true;
+}
+
+/**
+ * Moves the cuts between the slabs along each axis for balanceLoad(), each of
+ * our particles carrying the given weight, and migrates the particles to their
+ * new domains.
+ */
+template<size_t Dim>
+void Simulation<Dim>::balanceSlabs(size_t tstep, double weight)
+{
+	// histogram the load over the global cells along each axis
+	const auto& pos = particles.pos[tstep];
+
+	std::vector<double> local_weights[Dim];
+	for(size_t d=0;d<Dim;++d)
+		local_weights[d].assign(global_cell_counts[d],0.0);
+
+	for(size_t a=0;a<num_owned;++a)
+		for(size_t d=0;d<Dim;++d)
+		{
+			double c = floor(discard_dims(pos[a][d]/cell_sizes[d]));
+			size_t idx = (size_t)std::min(std::max(c,0.0),(double)(global_cell_counts[d]-1));
+			local_weights[d][idx] += weight;
+		}
+
+	for(size_t d=0;d<Dim;++d)
+	{
+		std::vector<double> weights(global_cell_counts[d]);
+		boost::mpi::all_reduce(comm,local_weights[d].data(),(int)global_cell_counts[d],weights.data(),std::plus<double>());
+
+		// each slab keeps at least two cells, where possible, so that a
+		// particle can still only move into a neighbouring domain between updates
+		findCuts(weights,global_cell_counts[d]>=2*domain_counts[d] ? 2 : 1,cell_cuts[d]);
+	}
+
+	applyDecomposition();
+	colourCells();
+
+	// particles may now be several domains from their new owner, they hop one
+	// neighbour per round so this is bounded by the number of domains
+	rebalancing = true;
+	size_t max_rounds = 0;
+	for(size_t d=0;d<Dim;++d)
+		max_rounds += domain_counts[d];
+
+	for(size_t round=0;;++round)
+	{
+		size_t outside = 0, global_outside;
+		for(size_t a=0;a<num_owned;++a)
+			if(!owns(pos[a]))
+				++outside;
+
+		boost::mpi::all_reduce(comm,outside,global_outside,std::plus<size_t>());
+		if(!global_outside)
+			break;
+
+		if(round==max_rounds)
+		{
+			rebalancing = false;
+			throw runtime_error("Particles did not reach their new domains while load balancing!");
+		}
+
+		exchangeOutOfBounds(tstep);
+	}
+	rebalancing = false;
+}
+
+/**
+ * Cuts the space filling curve into segments of equal load for balanceLoad(),
+ * each of our particles carrying the given weight, and sends the particles
+ * straight to their new owners. Segments can move anywhere along the curve so
+ * they are not passed between neighbours as in balanceSlabs().
+ */
+template<size_t Dim>
+void Simulation<Dim>::balanceCurve(size_t tstep, double weight)
+{
+	const auto& pos = particles.pos[tstep];
+	size_t num_cells = curve_order.size();
+
+	// histogram the load over the global cells
+	std::vector<double> local_weights(num_cells,0.0);
+	Subscript<Dim> wrap;
+	for(size_t a=0;a<num_owned;++a)
+		local_weights[globalCell(pos[a],wrap)] += weight;
+
+	std::vector<double> cell_weights(num_cells);
+	boost::mpi::all_reduce(comm,local_weights.data(),(int)num_cells,cell_weights.data(),std::plus<double>());
+
+	// then cut the curve
+	std::vector<double> weights(num_cells);
+	for(size_t k=0;k<num_cells;++k)
+		weights[k] = cell_weights[curve_order[k]];
+
+	findCuts(weights,1,curve_cuts);
+	applyCurve();
+	colourCells();
+
+	// send everything which isn't ours any more to its owner
+	sendToOwners(tstep);
+}
+
+/**
+ * Cuts a row of cells into cuts.size()-1 consecutive parts each holding
+ * roughly the same share of the total weight and at least min_cells cells.
+ * Part k covers cells cuts[k] to cuts[k+1]-1. The cuts are left alone if
+ * there is no weight.
+ */
+template<size_t Dim>
+void Simulation<Dim>::findCuts(const std::vector<double>& weights, size_t min_cells, std::vector<size_t>& cuts)
+{
+	size_t num_slabs = cuts.size()-1;
+	size_t num_cells = weights.size();
+
+	double total = std::accumulate(weights.begin(),weights.end(),0.0);
+	if(total<=0.0)
+		return;
+
+	cuts.assign(num_slabs+1,0);
+	cuts[num_slabs] = num_cells;
+
+	double cumulative = 0.0;
+	size_t c = 0;
+	for(size_t k=1;k<num_slabs;++k)
+	{
+		double target = total*k/num_slabs;
+
+		// take cells until the next one would overshoot the target by more than it undershoots
+		size_t lo = cuts[k-1]+min_cells;
+		size_t hi = num_cells-(num_slabs-k)*min_cells;
+		while(c<lo || (c<hi && cumulative+weights[c]/2<target))
+		{
+			cumulative += weights[c];
+			++c;
+		}
+
+		cuts[k] = c;
+	}
+}
+
+/**
+ * Calls visit(b) for each particle b in the stencil cells around x_sub which
+ * may interact with a. Within a's own cell only the particles from a onwards
+ * are visited so that each pair is seen once.
+ */
+template<size_t Dim> template<class F>
+void Simulation<Dim>::forEachCandidate(size_t a, const Subscript<Dim>& x_sub, F&& visit)
+{
+	for(Subscript<Dim>& dcell : stencil)
+	{
+		bool self = dcell==make_vect<Dim,int>(0);
+		size_t idx = cells.subToIdx(x_sub+dcell);
+
+		if(cells.sorted())
+		{
+			const std::vector<size_t>& order = cells.cellOrder();
+			size_t end = cells.cellStart(idx)+cells.cellSize(idx);
+
+			for(size_t k=(self ? cells.slotOf(a) : cells.cellStart(idx));k<end;++k)
+				visit(order[k]);
+		}
+		else
+		{
+			size_t b = self ? a : cells.cellHead(idx);
+
+			for(;b!=cells.npos;b=cells.nextInCell(b))
+				visit(b);
+		}
+	}
+}
+
+/**
+ * This function is used to actually perform the SPH sums over fluid & wall
+ * particles. It accepts any callable objects of the form
+ *
+ * void func(particle_type& a, particle_type& b, quantity<IntDim<0,-Dim,0>> W_ab, quantity<IntDim<0,-Dim-1,0>> gradW_ab)
+ *
+ * Note; if a value is returned it is discarded. The kernel needs static
+ * Kernel() and Grad() functions, if it also has Batch() like
+ * kernels::WendlandQuintic then all of a particle's neighbours are evaluated
+ * at once, see evaluateKernel(). If every function only uses the kernel value
+ * (see kernel_only) the pairs are found without any square roots where the
+ * kernel allows, the rest of their data is filled in by the first later sum
+ * which replays them and needs it.
+ */
+template<size_t Dim>
+template<template<int> class Kernel, typename... Fs>
+void Simulation<Dim>::doSPHSum(size_t tstep, Fs&&... fs)
+{
+	static_assert(sizeof...(Fs)>0,"No operations passed to doSPHSum()!");
+
+	auto sum_start = std::chrono::steady_clock::now(); // for balanceLoad()
+
+	const auto& pos = particles.pos[tstep];
+	const double cutoff2 = discard_dims(4.0_number*params.h*params.h); // (2h)^2
+	const bool distances = !all_kernel_only<Fs...>::value;
+
+	// if an earlier sum used the same positions and kernel then just replay the
+	// pairs and kernel values it found
+	const bool replay = cache_epoch==pos_epoch && cache_tstep==tstep && cache_kernel && *cache_kernel==typeid(Kernel<Dim>);
+
+	if(!replay)
+	{
+		// safety check, with neighbour lists particles are only moved to another
+		// process when the lists are rebuilt so may be slightly outside the domain.
+		// This is done up front as exceptions cannot leave a parallel region.
+		for(size_t a=0;a<num_owned;++a)
+			if(neighbours_valid ? !pdomain.inside(pos[a]) : !owns(pos[a]))
+			{
+				throw ParticleException<particle_type>(particles.get(a),"Particle out of domain");
+			}
+
+		if(!neighbours_valid && cells.sorted())
+			cells.buildTable();
+
+		cache_thread.resize(num_owned);
+		cache_start.resize(num_owned);
+		cache_end.resize(num_owned);
+		cache_b.resize(scheduler.threads());
+		cache_delta.resize(scheduler.threads());
+		pair_batches.resize(scheduler.threads());
+		for(size_t t=0;t<scheduler.threads();++t)
+		{
+			cache_b[t].clear();
+			cache_delta[t].clear();
+		}
+	}
+
+	// the pair data for the k'th pair in the batch, without the distance,
+	// direction and gradient if they weren't worked out
+	auto delta = [&](const PairBatch& batch, size_t k, bool with_distances) -> kernels::ParticleDelta<Dim>
+	{
+		if(!with_distances)
+			return kernels::ParticleDelta<Dim>{
+					quantity<length>(0.0),
+					make_vect<Dim,quantity<number>>(0.0),
+					quantity<IntDim<0,-(int)Dim,0>>(batch.W[k]),
+					quantity<IntDim<0,-1-(int)Dim,0>>(0.0)};
+
+		return kernels::ParticleDelta<Dim>{
+				quantity<length>(batch.dist[k]),
+				batch.r[k]*quantity<IntDim<0,-1,0>>(batch.inv_dist[k]),
+				quantity<IntDim<0,-(int)Dim,0>>(batch.W[k]),
+				quantity<IntDim<0,-1-(int)Dim,0>>(batch.dW[k])};
+	};
+
+	auto sum = [&](size_t a, size_t thread)
+	{
+		typename store_type::reference part_a = particles[a];
+
+		if(replay)
+		{
+			const std::vector<size_t>& bs = cache_b[cache_thread[a]];
+			std::vector<kernels::ParticleDelta<Dim>>& deltas = cache_delta[cache_thread[a]];
+
+			// the pairs were found by a sum which only needed the kernel
+			if(distances && !cache_distances)
+			{
+				PairBatch& batch = pair_batches[thread];
+				batch.r.clear();
+				batch.dist2.clear();
+				for(size_t k=cache_start[a];k<cache_end[a];++k)
+				{
+					qvect<Dim,length> r_ab = (pos[a]-pos[bs[k]]);
+					batch.r.push_back(r_ab);
+					batch.dist2.push_back(square_magnitude(r_ab));
+				}
+
+				evaluateKernel<Kernel>(batch,true);
+				for(size_t k=cache_start[a];k<cache_end[a];++k)
+					deltas[k] = delta(batch,k-cache_start[a],true);
+			}
+
+			for(size_t k=cache_start[a];k<cache_end[a];++k)
+			{
+				typename store_type::reference part_b = particles[bs[k]];
+				applyPair(part_a,part_b,deltas[k],std::forward<Fs>(fs)...);
+			}
+
+			return;
+		}
+
+		std::vector<size_t>& bs = cache_b[thread];
+		std::vector<kernels::ParticleDelta<Dim>>& deltas = cache_delta[thread];
+		PairBatch& batch = pair_batches[thread];
+		cache_thread[a] = thread;
+		cache_start[a] = bs.size();
+		batch.r.clear();
+		batch.dist2.clear();
+
+		// collect the particles within 2h, comparing squared distances so the
+		// square root is only taken for the pairs which are kept
+		auto visit = [&](size_t b)
+		{
+			qvect<Dim,length>	r_ab = (pos[a]-pos[b]);
+			double				dist2_ab = square_magnitude(r_ab);
+
+			// skip if more than 2h away
+			if(dist2_ab>=cutoff2)
+				return;
+
+			bs.push_back(b);
+			batch.r.push_back(r_ab);
+			batch.dist2.push_back(dist2_ab);
+		};
+
+		// iterate over nearby particles
+		if(neighbours_valid)
+			for(size_t k=nbr_start[a];k<nbr_start[a+1];++k)
+				visit(nbr_list[k]);
+		else
+			forEachCandidate(a,cells.posToSub(pos[a]),visit);
+
+		cache_end[a] = bs.size();
+
+		// evaluate the distances and kernel for all of them at once then apply the functions
+		size_t n = batch.dist2.size();
+		bool with_distances = evaluateKernel<Kernel>(batch,distances);
+
+		for(size_t k=0;k<n;++k)
+		{
+			deltas.push_back(delta(batch,k,with_distances));
+
+			typename store_type::reference part_b = particles[bs[cache_start[a]+k]];
+			applyPair(part_a,part_b,deltas.back(),std::forward<Fs>(fs)...);
+		}
+	};
+
+	if(exchange_in_flight)
+	{
+		// the particles which don't interact with any ghosts go first, hiding
+		// the exchange, then the rest once the ghosts have arrived
+		forEachOwned([&](size_t a, size_t thread)
+		{
+			if(!touchesGhosts(a,tstep)) sum(a,thread);
+		});
+
+		finishExchange();
+
+		forEachOwned([&](size_t a, size_t thread)
+		{
+			if(touchesGhosts(a,tstep)) sum(a,thread);
+		});
+	}
+	else
+		forEachOwned(sum);
+
+	if(!replay)
+	{
+		cache_epoch = pos_epoch;
+		cache_tstep = tstep;
+		cache_kernel = &typeid(Kernel<Dim>);
+		cache_distances = distances || kernel_batching<Kernel<Dim>>::value!=BatchSqKernel;
+	}
+	else
+		cache_distances = cache_distances || distances;
+
+	sum_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-sum_start).count();
+}
+
+/**
+ * Fills in the kernel for the squared distances in batch, along with the
+ * distances, their reciprocals and the magnitude of the kernel's gradient.
+ * If distances is false and the kernel has BatchSq() only the kernel is
+ * filled in, as no square roots are needed for it. Returns whether the rest
+ * was.
+ */
+template<size_t Dim> template<template<int> class K>
+bool Simulation<Dim>::evaluateKernel(PairBatch& batch, bool distances)
+{
+	size_t n = batch.dist2.size();
+	batch.dist.resize(n);
+	batch.inv_dist.resize(n);
+	batch.W.resize(n);
+	batch.dW.resize(n);
+
+	return evaluateKernel<K>(batch,distances,std::integral_constant<int,kernel_batching<K<Dim>>::value>());
+}
+
+// a kernel with only Kernel() and Grad()
+template<size_t Dim> template<template<int> class K>
+bool Simulation<Dim>::evaluateKernel(PairBatch& batch, bool distances, std::integral_constant<int,ScalarKernel>)
+{
+	utils::sqrt_and_reciprocal(batch.dist2.data(),batch.dist2.size(),batch.dist.data(),batch.inv_dist.data());
+	for(size_t k=0;k<batch.dist.size();++k)
+	{
+		quantity<length> r(batch.dist[k]);
+		batch.W[k] = discard_dims(K<Dim>::Kernel(r,params.h));
+		batch.dW[k] = discard_dims(K<Dim>::Grad(r,params.h));
+	}
+	return true;
+}
+
+template<size_t Dim> template<template<int> class K>
+bool Simulation<Dim>::evaluateKernel(PairBatch& batch, bool distances, std::integral_constant<int,BatchKernel>)
+{
+	utils::sqrt_and_reciprocal(batch.dist2.data(),batch.dist2.size(),batch.dist.data(),batch.inv_dist.data());
+	K<Dim>::Batch(batch.dist.data(),batch.dist.size(),params.h,batch.W.data(),batch.dW.data());
+	return true;
+}
+
+// BatchSq() gives |grad W|/r, which times the distance is the gradient
+template<size_t Dim> template<template<int> class K>
+bool Simulation<Dim>::evaluateKernel(PairBatch& batch, bool distances, std::integral_constant<int,BatchSqKernel>)
+{
+	size_t n = batch.dist2.size();
+	K<Dim>::BatchSq(batch.dist2.data(),n,params.h,batch.W.data(),batch.dW.data());
+	if(!distances)
+		return false;
+
+	utils::sqrt_and_reciprocal(batch.dist2.data(),n,batch.dist.data(),batch.inv_dist.data());
+	for(size_t k=0;k<n;++k)
+		batch.dW[k] *= batch.dist[k];
+	return true;
+}
+
+/**
+ * Calls f(a,thread) for each particle a we own, using the threads of the task
+ * scheduler. The cells are processed one colour at a time, cells of the same
+ * colour are far enough apart that the stencils around them never share a
+ * cell, so pair functions can update both particles without any locking.
+ * Within a colour the cells are split into blocks holding roughly equal
+ * numbers of particles, which the scheduler balances between the threads.
+ */
+template<size_t Dim> template<class F>
+void Simulation<Dim>::forEachOwnedColoured(F&& f)
+{
+	if(cells.sorted())
+		cells.buildTable();
+
+	std::vector<Task> blocks;
+
+	for(const std::vector<size_t>& colour : colour_cells)
+	{
+		size_t total = 0;
+		for(size_t idx : colour)
+			total += cells.cellSize(idx);
+
+		// aim for several blocks per thread so there is something to steal
+		size_t target = std::max<size_t>(1,total/(8*scheduler.threads()));
+
+		blocks.clear();
+		Task block{0,0,0};
+		for(size_t i=0;i<colour.size();++i)
+		{
+			block.last = i+1;
+			block.weight += cells.cellSize(colour[i]);
+
+			if(block.weight>=target)
+			{
+				blocks.push_back(block);
+				block = Task{i+1,i+1,0};
+			}
+		}
+		if(block.last>block.first)
+			blocks.push_back(block);
+
+		scheduler.run(blocks,[&](size_t first, size_t last, size_t thread)
+		{
+			for(size_t i=first;i<last;++i)
+				cells.forEachInCell(colour[i],[&](size_t a)
+				{
+					if(a<num_owned) f(a,thread);
+				});
+		});
+	}
+}
+
+/**
+ * Calls f(a,thread) for each particle a we own, on the threads of the task
+ * scheduler if there are several.
+ */
+template<size_t Dim> template<class F>
+void Simulation<Dim>::forEachOwned(F&& f)
+{
+	if(scheduler.threads()>1)
+		forEachOwnedColoured(f);
+	else
+		for(size_t a=0;a<num_owned;++a)
+			f(a,0);
+}
+
+/**
+ * Groups the non-padding cells into colours for forEachOwnedColoured(). The
+ * stencil spans (max-min+1) cells in each dimension so cells whose subscripts
+ * differ by a multiple of that never update the same particles.
+ */
+template<size_t Dim>
+void Simulation<Dim>::colourCells()
+{
+	Extent<Dim> period;
+	for(size_t d=0;d<Dim;++d)
+	{
+		int lo = 0, hi = 0;
+		for(Subscript<Dim>& s : stencil)
+		{
+			lo = std::min(lo,s[d]);
+			hi = std::max(hi,s[d]);
+		}
+		period[d] = hi-lo+1;
+	}
+
+	size_t num_colours = 1;
+	for(size_t d=0;d<Dim;++d)
+		num_colours *= period[d];
+
+	colour_cells.assign(num_colours,std::vector<size_t>());
+
+	utils::multi_for(make_vect<Dim,int>(0),vect_cast<int>(cells.cellCount()),[&](const Subscript<Dim>& sub)->void{
+		Subscript<Dim> colour;
+		for(size_t d=0;d<Dim;++d)
+			colour[d] = sub[d]%period[d];
+
+		colour_cells[sub_to_idx<Dim>(colour,period)].push_back(cells.subToIdx(sub));
+	});
+}
+
+/**
+ * Marks the cells holding the particles we send to our neighbours. Each
+ * neighbour sends the cells next to ours so the ghosts can only be next to
+ * these, the particles in them are the only ones which may interact with
+ * ghosts. Called by beginExchangeFull() before the ghosts arrive, so the
+ * particles away from them can be summed while they are in flight.
+ */
+template<size_t Dim>
+void Simulation<Dim>::findBorderCells()
+{
+	Extent<Dim> count = cells.cellCount();
+
+	size_t ncells = 1;
+	for(size_t d=0;d<Dim;++d)
+		ncells *= count[d]+2; // padding of one cell either side
+
+	border_cells.assign(ncells,0);
+
+	for(const std::vector<size_t>& sends : send_index)
+		for(size_t k : sends)
+			border_cells[particles.cell[k]] = 1;
+}
+
+/**
+ * Whether particle a we own may interact with any ghosts in doSPHSum().
+ */
+template<size_t Dim>
+bool Simulation<Dim>::touchesGhosts(size_t a, size_t tstep)
+{
+	if(neighbours_valid)
+		return nbr_ghosts[a];
+
+	return border_cells[cells.subToIdx(cells.posToSub(particles.pos[tstep][a]))];
+}
+
+/**
+ * Finishes the exchange in flight, if any, whether it was started by
+ * beginExchangeData() or beginExchangeFull().
+ */
+template<size_t Dim>
+void Simulation<Dim>::finishExchange()
+{
+	if(!exchange_in_flight)
+		return;
+
+	if(full_exchange)
+		finishExchangeFull();
+	else
+		finishExchangeData();
+}
+
+/**
+ * Updates the ghosts like exchangeData() while applying the given functions to
+ * the particles we own, as applyFunctions() would. The functions run while the
+ * messages are in flight, so the ghosts receive the values from before they
+ * were applied.
+ */
+template<size_t Dim>
+template<typename F, typename... Fs>
+void Simulation<Dim>::exchangeData(F&& f, Fs&&... fs)
+{
+	beginExchangeData();
+	applyFunctions(std::forward<F>(f),std::forward<Fs>(fs)...);
+	finishExchangeData();
+}
+
+/**
+ * Calls each of the pair functions passed to doSPHSum() on a single pair.
+ */
+template<size_t Dim>
+template<typename... Fs>
+void Simulation<Dim>::applyPair(typename store_type::reference& a, typename store_type::reference& b, const kernels::ParticleDelta<Dim>& delta, Fs&&... fs)
+{
+	// for explanation of this line see: http://stackoverflow.com/questions/18077259/variadic-function-accepting-functors-callable-objects
+	auto dummylist = { ((void)std::forward<Fs>(fs)(a,b,delta,*this),0)... };
+	(void)dummylist; // stop the compiler warning about unused variable
+}
+
+/**
+ * Works out the largest time step each fluid particle we own allows from its
+ * velocity and acceleration at tstep, once the accelerations have been summed:
+ *
+ *	dt <= cfl*h/(c+|v|), dt <= force*sqrt(h/|a|) and dt <= viscous*h^2*rho/mu
+ *
+ * then starts finding the smallest over all processes. The reduction is left
+ * in flight so it can be overlapped with moving the particles, the result is
+ * used for the next step by finishTimestepReduction().
+ */
+template<size_t Dim>
+void Simulation<Dim>::beginTimestepReduction(size_t tstep)
+{
+	if(dt_in_flight)
+		finishTimestepReduction();
+
+	const double h = discard_dims(params.h);
+	std::vector<double> thread_min(scheduler.threads(),dt_max);
+	scheduler.parallelFor(0,num_owned,[&](size_t i, size_t thread)
+	{
+		if(particles.type[i]!=FluidP) return;
+
+		const Fluid& f = fluids[particles.fluid[i]];
+		double v = discard_dims(particles.vel[tstep][i].magnitude());
+		double a = discard_dims(particles.acc[i].magnitude());
+		double mu = discard_dims(f.viscosity);
+
+		double limit = cfl_factor*h/(discard_dims(f.speed_of_sound)+v);
+		if(a>0.0)
+			limit = std::min(limit,force_factor*std::sqrt(h/a));
+		if(mu>0.0)
+			limit = std::min(limit,viscous_factor*h*h*discard_dims(f.density)/mu);
+		if(std::isnan(limit))
+			limit = 0.0; // stops the simulation in finishTimestepReduction()
+		thread_min[thread] = std::min(thread_min[thread],limit);
+	});
+
+	dt_local = *std::min_element(thread_min.begin(),thread_min.end());
+	BOOST_MPI_CHECK_RESULT(MPI_Iallreduce,(&dt_local,&dt_global,1,MPI_DOUBLE,MPI_MIN,(MPI_Comm)comm,&dt_request));
+	dt_in_flight = true;
+}
+
+/**
+ * Waits for the reduction started by beginTimestepReduction() and takes the
+ * result as the time step for the next step. A step smaller than dt_min means
+ * the simulation has gone unstable.
+ */
+template<size_t Dim>
+void Simulation<Dim>::finishTimestepReduction()
+{
+	if(!dt_in_flight) return;
+
+	BOOST_MPI_CHECK_RESULT(MPI_Wait,(&dt_request,MPI_STATUS_IGNORE));
+	dt_in_flight = false;
+
+	if(dt_global<dt_min)
+	{
+		if(!comm_rank) cerr << "Time step " << dt_global << " s is below dt_min!" << endl;
+		throw runtime_error("Time step below minimum!");
+	}
+	params.dt = quantity<dims::time>(dt_global);
+}
+
 /**
  * This funciton is used to apply functions / transformations to fluid and wall
  * particles. It accepts any callable objects of the form
@@ -761,21 +2904,32 @@ void Simulation<Dim>::applyFunctions(Fs&&... fs)
 {
 	static_assert(sizeof...(Fs)>0,"No operations passed to applyFunctions()!");
 
-	auto itr = fluid_particles.begin();
-	while(true)
+	// each function only changes the particle it is given so the particles can
+	// be shared out between threads freely
+	scheduler.parallelFor(0,num_owned,[&](size_t i, size_t thread)
 	{
-		// for explanation of this line see: http://stackoverflow.com/questions/18077259/variadic-function-accepting-functors-callable-objects
-		auto dummylist = { ((void)std::forward<Fs>(fs)(*itr,*this),0)... };
-		(void) dummylist; // hide warning about unused variable
+		applyToParticle(i,std::forward<Fs>(fs)...);
+	});
 
-		++itr;
+	// any cached pair data is stale once the particles have moved
+	if(any_moves_particles<Fs...>::value)
+		++pos_epoch;
+}
 
-		if(itr==fluid_particles.end())
-			itr = wall_particles.begin();
+/**
+ * Calls each of the functions passed to applyFunctions() on particle i, which
+ * does nothing if there are none.
+ */
+template<size_t Dim>
+template<typename... Fs>
+void Simulation<Dim>::applyToParticle(size_t i, Fs&&... fs)
+{
+	typename store_type::reference part = particles[i];
 
-		if(itr==wall_particles.end())
-			break;
-	}
+	// for explanation of this line see: http://stackoverflow.com/questions/18077259/variadic-function-accepting-functors-callable-objects
+	int dummylist[] = { 0, ((void)std::forward<Fs>(fs)(part,*this),0)... };
+	(void) dummylist; // hide warning about unused variable
+	(void) part;
 }
 
 } /* namespace sim */
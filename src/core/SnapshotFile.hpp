@@ -0,0 +1,181 @@
+#ifndef SNAPSHOTFILE_HPP_
+#define SNAPSHOTFILE_HPP_
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <mpi.h>
+#include <boost/mpi/exception.hpp>
+#include "Particle.hpp"
+
+namespace sim
+{
+
+/*
+ * A snapshot written by every process into a single shared file with
+ * collective MPI-IO, rather than one file per process.
+ *
+ * The file starts with a SnapshotHeader followed by num_fields SnapshotFields
+ * describing the layout of the records, then one record of record_size bytes
+ * per particle from data_offset onwards. Each process writes its particles as
+ * a contiguous run of records starting at the sum of the counts of the lower
+ * ranks, so the file is the same whatever the number of processes apart from
+ * the order of the particles, and it can be read back by any number of them.
+ *
+ * Everything is in the native byte order, all values are 8 bytes wide.
+ *
+ * The same file written with every particle's full state is used as a
+ * checkpoint, see Simulation::writeCheckpoint(), the time stepping state is
+ * then filled in too.
+ */
+struct SnapshotHeader
+{
+	enum { version_number = 2 };
+
+	char		magic[8];	   // "SPHSNAP" and a null
+	uint64_t	version;
+	uint64_t	dim;
+	uint64_t	file_number;
+	uint64_t	num_particles;
+	uint64_t	record_size;   // bytes
+	uint64_t	num_fields;
+	uint64_t	data_offset;   // bytes from the start of the file to the first record
+	double		period[3];	   // global domain extent, unused dimensions are zero
+	double		h;			   // smoothing length
+	double		dx;			   // particle spacing
+	double		dt;			   // time step
+	double		time;		   // simulated time, for checkpoints
+	uint64_t	step;		   // steps taken, for checkpoints
+};
+
+struct SnapshotField
+{
+	enum Type { Unsigned = 0, Double = 1 }; // 64 bit unsigned integers or doubles
+
+	char		name[24];	   // null terminated
+	uint64_t	type;
+	uint64_t	components;
+	uint64_t	offset;		   // bytes from the start of the record
+};
+
+inline SnapshotField snapshot_field(const char* name, SnapshotField::Type type, size_t components, size_t offset)
+{
+	SnapshotField field;
+	std::memset(&field,0,sizeof(field));
+	std::strncpy(field.name,name,sizeof(field.name)-1);
+	field.type = type;
+	field.components = components;
+	field.offset = offset;
+	return field;
+}
+
+/**
+ * Describes the records written straight from ParticleData.
+ */
+template<size_t Dim, size_t TStep, size_t NCol>
+std::vector<SnapshotField> particle_fields()
+{
+	typedef ParticleData<Dim,TStep,NCol> data_type;
+
+	std::vector<SnapshotField> fields;
+	fields.push_back(snapshot_field("fluid",SnapshotField::Unsigned,1,offsetof(data_type,fluid)));
+	fields.push_back(snapshot_field("wall",SnapshotField::Unsigned,1,offsetof(data_type,wall)));
+	fields.push_back(snapshot_field("id",SnapshotField::Unsigned,1,offsetof(data_type,id)));
+	fields.push_back(snapshot_field("type",SnapshotField::Unsigned,1,offsetof(data_type,type)));
+	fields.push_back(snapshot_field("pos",SnapshotField::Double,TStep*Dim,offsetof(data_type,pos)));
+	fields.push_back(snapshot_field("vel",SnapshotField::Double,TStep*Dim,offsetof(data_type,vel)));
+	fields.push_back(snapshot_field("acc",SnapshotField::Double,Dim,offsetof(data_type,acc)));
+	fields.push_back(snapshot_field("sigma",SnapshotField::Double,1,offsetof(data_type,sigma)));
+	fields.push_back(snapshot_field("density",SnapshotField::Double,TStep,offsetof(data_type,density)));
+	fields.push_back(snapshot_field("pressure",SnapshotField::Double,1,offsetof(data_type,pressure)));
+	fields.push_back(snapshot_field("gradC",SnapshotField::Double,NCol*Dim,offsetof(data_type,gradC)));
+	return fields;
+}
+
+/**
+ * Collectively writes n records of header.record_size bytes from each process
+ * to the file fname, replacing it if it exists. The particle count and offsets
+ * in the header are filled in here, the rest must be set by the caller.
+ */
+inline void write_snapshot(MPI_Comm comm, const std::string& fname, SnapshotHeader header, const std::vector<SnapshotField>& fields, const void* records, size_t n)
+{
+	int rank;
+	BOOST_MPI_CHECK_RESULT(MPI_Comm_rank,(comm,&rank));
+
+	// where our records start
+	uint64_t count = n, first = 0, total;
+	BOOST_MPI_CHECK_RESULT(MPI_Exscan,(&count,&first,1,MPI_UINT64_T,MPI_SUM,comm));
+	BOOST_MPI_CHECK_RESULT(MPI_Allreduce,(&count,&total,1,MPI_UINT64_T,MPI_SUM,comm));
+	if(rank==0) first = 0; // left undefined by MPI_Exscan
+
+	std::memcpy(header.magic,"SPHSNAP",8);
+	header.version = SnapshotHeader::version_number;
+	header.num_particles = total;
+	header.num_fields = fields.size();
+	header.data_offset = sizeof(SnapshotHeader) + fields.size()*sizeof(SnapshotField);
+
+	MPI_Datatype record;
+	BOOST_MPI_CHECK_RESULT(MPI_Type_contiguous,((int)header.record_size,MPI_BYTE,&record));
+	BOOST_MPI_CHECK_RESULT(MPI_Type_commit,(&record));
+
+	MPI_File fh;
+	BOOST_MPI_CHECK_RESULT(MPI_File_open,(comm,const_cast<char*>(fname.c_str()),MPI_MODE_CREATE|MPI_MODE_WRONLY,MPI_INFO_NULL,&fh));
+	BOOST_MPI_CHECK_RESULT(MPI_File_set_size,(fh,(MPI_Offset)(header.data_offset+total*header.record_size)));
+
+	if(rank==0)
+	{
+		BOOST_MPI_CHECK_RESULT(MPI_File_write_at,(fh,0,&header,(int)sizeof(header),MPI_BYTE,MPI_STATUS_IGNORE));
+		BOOST_MPI_CHECK_RESULT(MPI_File_write_at,(fh,(MPI_Offset)sizeof(header),const_cast<SnapshotField*>(fields.data()),(int)(fields.size()*sizeof(SnapshotField)),MPI_BYTE,MPI_STATUS_IGNORE));
+	}
+
+	MPI_Offset offset = header.data_offset + first*header.record_size;
+	BOOST_MPI_CHECK_RESULT(MPI_File_write_at_all,(fh,offset,const_cast<void*>(records),(int)n,record,MPI_STATUS_IGNORE));
+
+	BOOST_MPI_CHECK_RESULT(MPI_File_close,(&fh));
+	BOOST_MPI_CHECK_RESULT(MPI_Type_free,(&record));
+}
+
+/**
+ * Collectively reads a snapshot written by write_snapshot(), each process
+ * getting an even share of the records in file order.
+ */
+inline void read_snapshot(MPI_Comm comm, const std::string& fname, SnapshotHeader& header, std::vector<SnapshotField>& fields, std::vector<char>& records)
+{
+	int rank, size;
+	BOOST_MPI_CHECK_RESULT(MPI_Comm_rank,(comm,&rank));
+	BOOST_MPI_CHECK_RESULT(MPI_Comm_size,(comm,&size));
+
+	MPI_File fh;
+	BOOST_MPI_CHECK_RESULT(MPI_File_open,(comm,const_cast<char*>(fname.c_str()),MPI_MODE_RDONLY,MPI_INFO_NULL,&fh));
+
+	BOOST_MPI_CHECK_RESULT(MPI_File_read_at_all,(fh,0,&header,(int)sizeof(header),MPI_BYTE,MPI_STATUS_IGNORE));
+	if(std::strncmp(header.magic,"SPHSNAP",8)!=0 || header.version!=SnapshotHeader::version_number)
+	{
+		MPI_File_close(&fh);
+		throw std::runtime_error("Not a snapshot file: "+fname);
+	}
+
+	fields.resize(header.num_fields);
+	BOOST_MPI_CHECK_RESULT(MPI_File_read_at_all,(fh,(MPI_Offset)sizeof(header),fields.data(),(int)(fields.size()*sizeof(SnapshotField)),MPI_BYTE,MPI_STATUS_IGNORE));
+
+	uint64_t first = header.num_particles*rank/size;
+	uint64_t last = header.num_particles*(rank+1)/size;
+
+	MPI_Datatype record;
+	BOOST_MPI_CHECK_RESULT(MPI_Type_contiguous,((int)header.record_size,MPI_BYTE,&record));
+	BOOST_MPI_CHECK_RESULT(MPI_Type_commit,(&record));
+
+	records.resize((last-first)*header.record_size);
+	MPI_Offset offset = header.data_offset + first*header.record_size;
+	BOOST_MPI_CHECK_RESULT(MPI_File_read_at_all,(fh,offset,records.data(),(int)(last-first),record,MPI_STATUS_IGNORE));
+
+	BOOST_MPI_CHECK_RESULT(MPI_File_close,(&fh));
+	BOOST_MPI_CHECK_RESULT(MPI_Type_free,(&record));
+}
+
+} /* namespace sim */
+
+#endif /* SNAPSHOTFILE_HPP_ */
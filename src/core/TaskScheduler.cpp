@@ -0,0 +1,119 @@
+#include "TaskScheduler.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace sim
+{
+
+TaskScheduler::TaskScheduler()
+{
+	setThreads(1);
+}
+
+/**
+ * Sets the number of threads used by run(), this also resets the timings.
+ */
+void TaskScheduler::setThreads(size_t n)
+{
+	num_threads = std::max<size_t>(n,1);
+
+	queues.clear();
+	for(size_t t=0;t<num_threads;++t)
+		queues.emplace_back(new Queue());
+
+	resetTimes();
+}
+
+size_t TaskScheduler::threads() const
+{
+	return num_threads;
+}
+
+const vector<double>& TaskScheduler::busyTime() const
+{
+	return busy;
+}
+
+const vector<double>& TaskScheduler::idleTime() const
+{
+	return idle;
+}
+
+void TaskScheduler::resetTimes()
+{
+	busy.assign(num_threads,0.0);
+	idle.assign(num_threads,0.0);
+}
+
+/**
+ * Deals the tasks out to the threads in contiguous blocks so that each thread
+ * starts with about the same total weight.
+ */
+void TaskScheduler::distribute(const vector<Task>& tasks)
+{
+	size_t total = 0;
+	for(const Task& task : tasks)
+		total += task.weight;
+
+	size_t thread = 0;
+	size_t sum = 0;
+	for(size_t i=0;i<tasks.size();++i)
+	{
+		// move on once this thread has its share of the total weight
+		while(thread+1<num_threads && sum*num_threads>=total*(thread+1))
+			++thread;
+
+		queues[thread]->tasks.push_back(i);
+		sum += tasks[i].weight;
+	}
+}
+
+/**
+ * Gets the next task for a thread, from its own queue if possible otherwise
+ * stolen from another thread. Returns false once there are no tasks left.
+ */
+bool TaskScheduler::next(size_t thread, size_t& task)
+{
+	{
+		Queue& own = *queues[thread];
+		lock_guard<mutex> guard(own.lock);
+		if(!own.tasks.empty())
+		{
+			task = own.tasks.front();
+			own.tasks.pop_front();
+			return true;
+		}
+	}
+
+	for(size_t i=1;i<num_threads;++i)
+	{
+		Queue& victim = *queues[(thread+i)%num_threads];
+		lock_guard<mutex> guard(victim.lock);
+		if(!victim.tasks.empty())
+		{
+			task = victim.tasks.back();
+			victim.tasks.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+size_t TaskScheduler::threadNum()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+double TaskScheduler::seconds(clock::time_point from, clock::time_point to)
+{
+	return chrono::duration<double>(to-from).count();
+}
+
+} /* namespace sim */
@@ -0,0 +1,137 @@
+#ifndef TASKSCHEDULER_HPP_
+#define TASKSCHEDULER_HPP_
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace sim
+{
+
+/*
+ * A contiguous range of work items, e.g. cells or particles, and an estimate
+ * of how expensive it is.
+ */
+struct Task
+{
+	size_t first;
+	size_t last;
+	size_t weight;
+};
+
+/*
+ * Runs tasks on a team of OpenMP threads. The tasks are first dealt out to
+ * the threads in contiguous blocks of roughly equal weight, each thread then
+ * works through its own block from the front and once that is empty steals
+ * tasks from the back of the other threads' blocks. This keeps all threads
+ * busy when the weights are only a rough guide to the cost.
+ *
+ * The time each thread spends running tasks (busy) and searching for or
+ * waiting on work (idle) is accumulated so the imbalance can be reported.
+ */
+class TaskScheduler
+{
+public:
+	TaskScheduler();
+
+	void setThreads(size_t n);
+	size_t threads() const;
+
+	template<class F> void run(const std::vector<Task>& tasks, F&& f);
+	template<class F> void parallelFor(size_t first, size_t last, F&& f);
+
+	const std::vector<double>& busyTime() const;
+	const std::vector<double>& idleTime() const;
+	void resetTimes();
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct Queue
+	{
+		std::mutex			lock;
+		std::deque<size_t>	tasks;
+	};
+
+	void distribute(const std::vector<Task>& tasks);
+	bool next(size_t thread, size_t& task);
+	static size_t threadNum();
+	static double seconds(clock::time_point from, clock::time_point to);
+
+	size_t								num_threads;
+	std::vector<std::unique_ptr<Queue>>	queues;	 // one per thread, mutexes can't be moved
+	std::vector<double>					busy;	 // seconds spent running tasks
+	std::vector<double>					idle;	 // seconds spent without a task
+};
+
+/**
+ * Calls f(first,last,thread) for each task, where thread is in [0,threads()).
+ * f must not throw.
+ */
+template<class F>
+void TaskScheduler::run(const std::vector<Task>& tasks, F&& f)
+{
+	if(num_threads==1)
+	{
+		clock::time_point start = clock::now();
+		for(const Task& task : tasks)
+			f(task.first,task.last,(size_t)0);
+		busy[0] += seconds(start,clock::now());
+		return;
+	}
+
+	distribute(tasks);
+
+	#pragma omp parallel num_threads(num_threads)
+	{
+		size_t thread = threadNum();
+		double busy_here = 0.0;
+		clock::time_point start = clock::now();
+
+		size_t task;
+		while(next(thread,task))
+		{
+			clock::time_point task_start = clock::now();
+			f(tasks[task].first,tasks[task].last,thread);
+			busy_here += seconds(task_start,clock::now());
+		}
+
+		// wait for the others so that time spent waiting counts as idle
+		#pragma omp barrier
+
+		busy[thread] += busy_here;
+		idle[thread] += seconds(start,clock::now()) - busy_here;
+	}
+}
+
+/**
+ * Calls f(i,thread) for each i in [first,last), splitting the range into a few
+ * equally weighted tasks per thread.
+ */
+template<class F>
+void TaskScheduler::parallelFor(size_t first, size_t last, F&& f)
+{
+	if(last<=first) return;
+
+	size_t grain = std::max<size_t>(1,(last-first)/(8*num_threads));
+
+	std::vector<Task> tasks;
+	for(size_t i=first;i<last;i+=grain)
+		tasks.push_back(Task{i,std::min(i+grain,last),std::min(i+grain,last)-i});
+
+	run(tasks,[&](size_t task_first, size_t task_last, size_t thread)
+	{
+		for(size_t i=task_first;i<task_last;++i)
+			f(i,thread);
+	});
+}
+
+} /* namespace sim */
+
+#endif /* TASKSCHEDULER_HPP_ */
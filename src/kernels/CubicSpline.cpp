@@ -0,0 +1,31 @@
+#include "CubicSpline.hpp"
+
+#include <algorithm>
+
+namespace sim
+{
+namespace kernels
+{
+
+template<> const quantity<number> CubicSpline<2>::C(0.454728408833986673625382181064326748669884702115589853564763); // 10/(7pi)
+template<> const quantity<number> CubicSpline<3>::C(0.318309886183790671537767526745028724068919291480912897495334); // 1/pi
+
+/**
+ * Writes the two pieces of the spline as (2-q)^3/4 - (1-q)^3 with both terms
+ * clamped at zero, which avoids branching on q.
+ */
+void cubic_spline_batch(const double* r, size_t n, double inv_h, double kernel_fac, double grad_fac, double* W, double* dW)
+{
+	for(size_t i=0;i<n;++i)
+	{
+		double q = r[i]*inv_h;
+		double x = std::max(2.0-q,0.0);
+		double y = std::max(1.0-q,0.0);
+
+		W[i] = kernel_fac*(0.25*x*x*x - y*y*y);
+		dW[i] = grad_fac*(0.75*x*x - 3.0*y*y);
+	}
+}
+
+}
+}
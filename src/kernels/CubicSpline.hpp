@@ -0,0 +1,65 @@
+#ifndef CUBICSPLINE_HPP_
+#define CUBICSPLINE_HPP_
+
+#include <cstddef>
+#include "dims.hpp"
+
+namespace sim
+{
+namespace kernels
+{
+
+using namespace dims;
+
+// batch evaluation shared by all dimensions, see CubicSpline<Dim>::Batch
+void cubic_spline_batch(const double* r, size_t n, double inv_h, double kernel_fac, double grad_fac, double* W, double* dW);
+
+/*
+ * The M4 cubic B-spline kernel with support 2h. Cheaper than the Wendland
+ * kernels but prone to pairing instability at high neighbour counts.
+ */
+template<int Dim>
+struct CubicSpline
+{
+	static quantity<IntDim<0,-Dim,0>>   Kernel(quantity<length> r, quantity<length> h) {
+		auto q = r/h;
+		if(q<1.0_number)
+			return C*(1.0_number - 1.5_number*q*q + 0.75_number*q*q*q)*pow<-(int)Dim>(h);
+		else if(q<2.0_number)
+		{
+			auto x = 2.0_number-q;
+			return C*0.25_number*x*x*x*pow<-(int)Dim>(h);
+		}
+		else return quantity<IntDim<0,-Dim,0>>(0.);
+	}
+
+	static quantity<IntDim<0,-Dim-1,0>> Grad(quantity<length> r, quantity<length> h) {
+		auto q = r/h;
+		if(q<1.0_number)
+			return C*(3.0_number*q - 2.25_number*q*q)*pow<-Dim-1>(h);
+		else if(q<2.0_number)
+		{
+			auto x = 2.0_number-q;
+			return C*0.75_number*x*x*pow<-Dim-1>(h);
+		}
+		else return quantity<IntDim<0,-Dim-1,0>>(0.);
+	}
+
+	/*
+	 * Evaluates the kernel and the magnitude of its gradient for n distances at
+	 * once, see WendlandQuintic::Batch.
+	 */
+	static void Batch(const double* r, size_t n, quantity<length> h, double* W, double* dW) {
+		cubic_spline_batch(r,n,1.0/discard_dims(h),
+				discard_dims(C*pow<-(int)Dim>(h)),discard_dims(C*pow<-Dim-1>(h)),W,dW);
+	}
+
+private:
+	static const quantity<number> C; // normalization constant
+};
+
+} /* namespace kernels */
+} /* namespace sim */
+
+
+#endif /* CUBICSPLINE_HPP_ */
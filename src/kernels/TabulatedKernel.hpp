@@ -0,0 +1,127 @@
+#ifndef TABULATEDKERNEL_HPP_
+#define TABULATEDKERNEL_HPP_
+
+#include <cstddef>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "dims.hpp"
+#include "WendlandQuintic.hpp"
+#include "WendlandC4.hpp"
+#include "WendlandC6.hpp"
+#include "CubicSpline.hpp"
+
+namespace sim
+{
+namespace kernels
+{
+
+using namespace dims;
+
+/*
+ * Replaces the evaluation of another kernel with linear interpolation in a
+ * table of N samples of W and |grad W|/q against q^2, built the first time it
+ * is used. Interpolating in q^2 means callers which already have the squared
+ * distance can use BatchSq() and skip the square root. The gradient is stored
+ * divided by q as it is then smooth in q^2 near q=0. Any kernel with the
+ * same interface as WendlandQuintic and support 2h can be tabulated, e.g.
+ *
+ *   template<int Dim> using MyKernel = TabulatedKernel<CubicSpline,Dim>;
+ *   sim.doSPHSum<MyKernel>(...);
+ */
+template<template<int> class Base, int Dim, size_t N=2048>
+struct TabulatedKernel
+{
+	static_assert(N>2,"TabulatedKernel needs at least three samples!");
+
+	static quantity<IntDim<0,-Dim,0>>   Kernel(quantity<length> r, quantity<length> h) {
+		double q = discard_dims(r/h);
+		return quantity<number>(interpolate(table().W,q*q))*pow<-(int)Dim>(h);
+	}
+
+	static quantity<IntDim<0,-Dim-1,0>> Grad(quantity<length> r, quantity<length> h) {
+		double q = discard_dims(r/h);
+		return quantity<number>(q*interpolate(table().dW,q*q))*pow<-Dim-1>(h);
+	}
+
+	/*
+	 * Evaluates the kernel and the magnitude of its gradient for n distances at
+	 * once, see WendlandQuintic::Batch.
+	 */
+	static void Batch(const double* r, size_t n, quantity<length> h, double* W, double* dW) {
+		const Table& t = table();
+		double inv_h = 1.0/discard_dims(h);
+		double kernel_fac = discard_dims(pow<-(int)Dim>(h));
+		double grad_fac = discard_dims(pow<-Dim-1>(h));
+
+		for(size_t i=0;i<n;++i)
+		{
+			double q = r[i]*inv_h;
+			W[i] = kernel_fac*interpolate(t.W,q*q);
+			dW[i] = grad_fac*q*interpolate(t.dW,q*q);
+		}
+	}
+
+	/*
+	 * As Batch() but takes the squared distances r2 in m^2 and gives
+	 * |grad W|/r in m^-Dim-2, which multiplied by the separation vector gives
+	 * the gradient without needing the distance itself.
+	 */
+	static void BatchSq(const double* r2, size_t n, quantity<length> h, double* W, double* dW) {
+		const Table& t = table();
+		double inv_h2 = 1.0/discard_dims(h*h);
+		double kernel_fac = discard_dims(pow<-(int)Dim>(h));
+		double grad_fac = discard_dims(pow<-Dim-2>(h));
+
+		for(size_t i=0;i<n;++i)
+		{
+			W[i] = kernel_fac*interpolate(t.W,r2[i]*inv_h2);
+			dW[i] = grad_fac*interpolate(t.dW,r2[i]*inv_h2);
+		}
+	}
+
+private:
+	// samples at q^2 = 4k/(N-1) for h=1, plus a trailing zero so that
+	// interpolation past q=2 needs no special case
+	struct Table
+	{
+		std::vector<double> W;
+		std::vector<double> dW; // |grad W|/q
+
+		Table():W(N+1,0.0),dW(N+1,0.0)
+		{
+			for(size_t k=0;k<N;++k)
+			{
+				// |grad W|/q is finite at q=0, sample just beside it
+				double q = std::max(std::sqrt(4.0*k/(N-1)),1e-8);
+				W[k] = discard_dims(Base<Dim>::Kernel(quantity<length>(q),quantity<length>(1.0)));
+				dW[k] = discard_dims(Base<Dim>::Grad(quantity<length>(q),quantity<length>(1.0)))/q;
+			}
+
+			W[N-1] = dW[N-1] = 0.0; // q=2 exactly
+		}
+	};
+
+	static const Table& table() {
+		static const Table t; // initialisation is thread safe
+		return t;
+	}
+
+	static double interpolate(const std::vector<double>& v, double q2) {
+		double x = std::min(q2,4.0)*((N-1)/4.0);
+		size_t k = (size_t)x;
+		return v[k] + (v[k+1]-v[k])*(x-k);
+	}
+};
+
+// tabulated versions of each of the kernels
+template<int Dim> using TabulatedWendlandQuintic = TabulatedKernel<WendlandQuintic,Dim>;
+template<int Dim> using TabulatedWendlandC4 = TabulatedKernel<WendlandC4,Dim>;
+template<int Dim> using TabulatedWendlandC6 = TabulatedKernel<WendlandC6,Dim>;
+template<int Dim> using TabulatedCubicSpline = TabulatedKernel<CubicSpline,Dim>;
+
+} /* namespace kernels */
+} /* namespace sim */
+
+
+#endif /* TABULATEDKERNEL_HPP_ */
@@ -0,0 +1,39 @@
+#ifndef WENDLANDBATCH_HPP_
+#define WENDLANDBATCH_HPP_
+
+#include <cstddef>
+#include <algorithm>
+
+namespace sim
+{
+namespace kernels
+{
+
+/*
+ * Batch evaluation shared by the Wendland kernels with support 2h, which are
+ * all of the form
+ *
+ *   W = kernel_fac*x^P*Poly::kernel(q) and |grad W| = grad_fac*q*x^(P-1)*Poly::grad(q)
+ *
+ * where q = r/h and x = 1-q/2. Poly::power(x) gives x^(P-1) by repeated
+ * multiplication, so the loop has no calls to pow() and can be vectorised.
+ * Clamping x at zero takes the place of the q<2 test so there are no branches.
+ */
+template<class Poly>
+void wendland_batch(const double* r, size_t n, double inv_h, double kernel_fac, double grad_fac, double* W, double* dW)
+{
+	for(size_t i=0;i<n;++i)
+	{
+		double q = r[i]*inv_h;
+		double x = std::max(1.0-q*0.5,0.0);
+		double xp = Poly::power(x);
+
+		W[i] = kernel_fac*x*xp*Poly::kernel(q);
+		dW[i] = grad_fac*q*xp*Poly::grad(q);
+	}
+}
+
+} /* namespace kernels */
+} /* namespace sim */
+
+#endif /* WENDLANDBATCH_HPP_ */
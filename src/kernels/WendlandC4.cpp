@@ -0,0 +1,32 @@
+#include "WendlandC4.hpp"
+
+#include "WendlandBatch.hpp"
+
+namespace sim
+{
+namespace kernels
+{
+
+template<> const quantity<number> WendlandC4<2>::C(0.716197243913529010959976935176314629155068405832054019364503); // 9/(4pi)
+template<> const quantity<number> WendlandC4<3>::C(0.615482006488188993793730178667145384430136911261921422891369); // 495/(256pi)
+
+namespace
+{
+
+// W = C*x^6*(35q^2/12+3q+1), |grad W| = C*(14/3)*q*(1+5q/2)*x^5
+struct WendlandC4Poly
+{
+	static double power(double x)  { double x2 = x*x; return x2*x2*x; }
+	static double kernel(double q) { return (35.0/12.0*q+3.0)*q+1.0; }
+	static double grad(double q)   { return (14.0/3.0)*(1.0+2.5*q); }
+};
+
+}
+
+void wendland_c4_batch(const double* r, size_t n, double inv_h, double kernel_fac, double grad_fac, double* W, double* dW)
+{
+	wendland_batch<WendlandC4Poly>(r,n,inv_h,kernel_fac,grad_fac,W,dW);
+}
+
+}
+}
@@ -0,0 +1,32 @@
+#include "WendlandC6.hpp"
+
+#include "WendlandBatch.hpp"
+
+namespace sim
+{
+namespace kernels
+{
+
+template<> const quantity<number> WendlandC6<2>::C(0.886720397226274013569495253075437159906275169125400214451289); // 39/(14pi)
+template<> const quantity<number> WendlandC6<3>::C(0.848619130157957552048931003919851969441552407952043173986585); // 1365/(512pi)
+
+namespace
+{
+
+// W = C*x^8*(4q^3+25q^2/4+4q+1), |grad W| = C*(11/2)*q*(1+7q/2+4q^2)*x^7
+struct WendlandC6Poly
+{
+	static double power(double x)  { double x2 = x*x; double x4 = x2*x2; return x4*x2*x; }
+	static double kernel(double q) { return ((4.0*q+6.25)*q+4.0)*q+1.0; }
+	static double grad(double q)   { return 5.5*(1.0+(3.5+4.0*q)*q); }
+};
+
+}
+
+void wendland_c6_batch(const double* r, size_t n, double inv_h, double kernel_fac, double grad_fac, double* W, double* dW)
+{
+	wendland_batch<WendlandC6Poly>(r,n,inv_h,kernel_fac,grad_fac,W,dW);
+}
+
+}
+}
@@ -0,0 +1,60 @@
+#ifndef WENDLANDC6_HPP_
+#define WENDLANDC6_HPP_
+
+#include <cstddef>
+#include "dims.hpp"
+
+namespace sim
+{
+namespace kernels
+{
+
+using namespace dims;
+
+// batch evaluation shared by all dimensions, see WendlandC6<Dim>::Batch
+void wendland_c6_batch(const double* r, size_t n, double inv_h, double kernel_fac, double grad_fac, double* W, double* dW);
+
+/*
+ * The Wendland C6 kernel with support 2h. C6 continuous, the smoothest and most expensive of the Wendland kernels.
+ */
+template<int Dim>
+struct WendlandC6
+{
+	static quantity<IntDim<0,-Dim,0>>   Kernel(quantity<length> r, quantity<length> h) {
+		auto q = r/h;
+		if(q<2.0_number)
+		{
+			auto x = (1.0_number-q*0.5_number);
+			return C*pow<8>(x)*(4.0_number*q*q*q+6.25_number*q*q+4.0_number*q+1.0_number)*pow<-(int)Dim>(h);
+		}
+		else return quantity<IntDim<0,-Dim,0>>(0.);
+	}
+
+	static quantity<IntDim<0,-Dim-1,0>> Grad(quantity<length> r, quantity<length> h) {
+		auto q = r/h;
+		if(q<2.0_number)
+		{
+			auto x = (1.0_number-q*0.5_number);
+			return C*5.5_number*q*(1.0_number+3.5_number*q+4.0_number*q*q)*pow<7>(x)*pow<-Dim-1>(h);
+		}
+		else return quantity<IntDim<0,-Dim-1,0>>(0.);
+	}
+
+	/*
+	 * Evaluates the kernel and the magnitude of its gradient for n distances at
+	 * once, see WendlandQuintic::Batch.
+	 */
+	static void Batch(const double* r, size_t n, quantity<length> h, double* W, double* dW) {
+		wendland_c6_batch(r,n,1.0/discard_dims(h),
+				discard_dims(C*pow<-(int)Dim>(h)),discard_dims(C*pow<-Dim-1>(h)),W,dW);
+	}
+
+private:
+	static const quantity<number> C; // normalization constant
+};
+
+} /* namespace kernels */
+} /* namespace sim */
+
+
+#endif /* WENDLANDC6_HPP_ */
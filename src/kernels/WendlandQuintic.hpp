@@ -1,6 +1,7 @@
 #ifndef WENDLANDQUINTIC_HPP_
 #define WENDLANDQUINTIC_HPP_
 
+#include <cstddef>
 #include "dims.hpp"
 
 namespace sim
@@ -10,6 +11,9 @@ namespace kernels
 
 using namespace dims;
 
+// batch evaluation shared by all dimensions, see WendlandQuintic<Dim>::Batch
+void wendland_quintic_batch(const double* r, size_t n, double inv_h, double kernel_fac, double grad_fac, double* W, double* dW);
+
 template<int Dim>
 struct WendlandQuintic
 {
@@ -36,10 +40,23 @@ struct WendlandQuintic
 		else return quantity<IntDim<0,-Dim-1,0>>(0.);
 	}
 
+	/*
+	 * Evaluates the kernel and the magnitude of its gradient for n distances at
+	 * once. The arrays hold plain values in SI units, i.e. r in m, W in m^-Dim
+	 * and dW in m^-Dim-1. Distances of 2h or more give zero.
+	 */
+	static void Batch(const double* r, size_t n, quantity<length> h, double* W, double* dW) {
+		wendland_quintic_batch(r,n,1.0/discard_dims(h),
+				discard_dims(C*pow<-(int)Dim>(h)),discard_dims(5.0_number*C*pow<-Dim-1>(h)),W,dW);
+	}
+
 private:
 	static const quantity<number> C; // normalization constant
 };
 
+// the quintic Wendland kernel is the C2 member of the Wendland family
+template<int Dim> using WendlandC2 = WendlandQuintic<Dim>;
+
 } /* namespace kernels */
 } /* namespace sim */
 
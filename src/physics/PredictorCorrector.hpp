@@ -52,6 +52,11 @@ struct PredictorCorrectorUpdater<1,Dim>
 };
 
 }
+
+// both steps move the particles
+template<size_t Step, size_t Dim>
+struct moves_particles<physics::PredictorCorrectorUpdater<Step,Dim>> : std::true_type {};
+
 }
 
 #endif /* PREDICTORCORRECTOR_HPP_ */
@@ -114,6 +114,11 @@ struct DensityCalc {
 };
 
 }
+
+// sigma only needs the kernel value
+template<int Dim>
+struct kernel_only<physics::SigmaCalc<Dim>> : std::true_type {};
+
 }
 
 
@@ -3,8 +3,10 @@
 #include <iomanip>
 #include <boost/mpi/environment.hpp>
 #include <boost/mpi/nonblocking.hpp>
+#include <boost/mpi/timer.hpp>
 
 #include "core/Simulation.hpp"
+#include "core/OutputScheduler.hpp"
 #include "physics/PredictorCorrector.hpp"
 #include "physics/Sigma.hpp"
 #include "kernels/WendlandQuintic.hpp"
@@ -42,37 +44,95 @@ int run_main(int argc, char* argv[], boost::mpi::environment& env)
 	// currently only takes one argument - the config file name
 	theSim.loadConfigXML(string(argv[1]));
 
-	size_t file_number = 0;
-	theSim.writeOutput(file_number);
-	++file_number;
+	// a restarted simulation carries on from its checkpoint
+	const Simulation<DIM>::RestartPoint& restart = theSim.restartPoint();
+	size_t file_number = restart.file_number;
+	size_t step = restart.step;
+
+	// each kind of output is written at its own cadence by its own writer
+	OutputScheduler outputs;
+	outputs.addStream("snapshots",discard_dims(theSim.parameters().tout),0,[&](size_t, double)
+	{
+		theSim.writeOutput(file_number);
+		++file_number;
+	});
+	if(theSim.probeCount())
+	{
+		outputs.addStream("probes",theSim.probeInterval(),1,[&](size_t, double time)
+		{
+			theSim.writeProbes<kernels::WendlandQuintic>(time);
+		});
+	}
+	if(theSim.checkpointInterval())
+	{
+		// after the snapshots so the checkpoint has the number of the next one
+		outputs.addStream("checkpoints",0.0,theSim.checkpointInterval(),[&](size_t taken, double time)
+		{
+			theSim.writeCheckpoint(taken,time,file_number);
+		});
+	}
+	outputs.start(step,restart.time,restart.restarted);
+
+	// the fused pipeline gives the same results with fewer passes over the
+	// particles, the unfused path is kept to compare against
+	const bool fused = theSim.fusedPipeline();
+	if(comm.rank()==0) cout << "Fused pipeline: " << fused << endl;
+
+	// leave ghost exchanges in flight while the next sum starts on the interior
+	const bool overlap = theSim.overlapExchange();
+	if(comm.rank()==0) cout << "Overlapped exchange: " << overlap << endl;
+
+	// work out the next time step from the particles while they are moved
+	const bool adaptive = theSim.adaptiveTimestep();
+	if(comm.rank()==0) cout << "Adaptive time step: " << adaptive << endl;
+
+	boost::mpi::timer step_timer;
+	size_t cell_changes = 0;
 
 	double tmax = discard_dims(theSim.parameters().tmax);
-	for(double t=0.;t<tmax; t += discard_dims(theSim.parameters().dt))
+	double dt = discard_dims(theSim.parameters().dt);
+	for(double t=restart.time;t<tmax; t += dt)
 	{
-		if(comm.rank()==0) cout << "t = " << t << endl;
+		dt = discard_dims(theSim.parameters().dt); // for this step, the next may differ
+		if(comm.rank()==0) cout << "t = " << t << ", dt = " << dt << endl;
 
 		/*
 		 * Half-step
 		 */
 
-		theSim.applyFunctions(physics::ResetVals<DIM>());	// set values to zero
-		theSim.placeParticlesIntoLinkedCellGrid(0);
+		theSim.balanceLoad(0); // every few steps, before the cells and ghosts are rebuilt
 
-		comm.barrier();
-		theSim.exchangeFull();
+		if(fused)
+			theSim.updateNeighbours(0,physics::ResetVals<DIM>());	// set values to zero while checking for moved particles
+		else
+		{
+			theSim.updateNeighbours(0);
+			theSim.applyFunctions(physics::ResetVals<DIM>());	// set values to zero
+		}
 
-		comm.barrier();
+		cell_changes += theSim.cellChanges(); // reported at the end, a reduction here would hold up the step
+
+		if(!overlap) comm.barrier(); // would hold up the sum waiting on the exchange
 		if(comm.rank()==0) cout << "HERE 0" << endl;
 
 		// calculate sigma
 		theSim.doSPHSum<kernels::WendlandQuintic>(0,physics::SigmaCalc<DIM>());
 		if(comm.rank()==0) cout << "HERE 0.1" << endl;
-		theSim.exchangeData();
-
-		if(comm.rank()==0) cout << "HERE 1" << endl;
 
 		// calculate density then pressure
-		theSim.applyFunctions(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>());
+		if(overlap)
+		{
+			theSim.beginExchangeData(); // finished by the acceleration sum
+			theSim.applyFunctions(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>());
+		}
+		else if(fused)
+			theSim.exchangeData(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>()); // while the ghosts are exchanged
+		else
+		{
+			theSim.exchangeData();
+			if(comm.rank()==0) cout << "HERE 1" << endl;
+			theSim.applyFunctions(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>());
+		}
 
 		if(comm.rank()==0) cout << "HERE 2" << endl;
 
@@ -81,40 +141,49 @@ int run_main(int argc, char* argv[], boost::mpi::environment& env)
 
 		if(comm.rank()==0) cout << "HERE 3" << endl;
 
-		// move particles
-		theSim.applyFunctions(physics::PredictorCorrectorUpdater<0,DIM>());
-
-		if(comm.rank()==0) cout << "HERE 4" << endl;
-
 		/*
 		 * Full step
 		 */
 
-		theSim.exchangeOutOfBounds(1);
+		if(fused)
+		{
+			// move particles and set values to zero while checking for moved particles
+			theSim.updateNeighbours(1,physics::PredictorCorrectorUpdater<0,DIM>(),physics::ResetVals<DIM>());
+		}
+		else
+		{
+			// move particles
+			theSim.applyFunctions(physics::PredictorCorrectorUpdater<0,DIM>());
 
-		comm.barrier();
-		if(comm.rank()==0) cout << "HERE 5" << endl;
+			if(comm.rank()==0) cout << "HERE 4" << endl;
 
-		theSim.applyFunctions(physics::ResetVals<DIM>());	// set values to zero
-		comm.barrier();
-		if(comm.rank()==0) cout << "HERE 5.1" << endl;
+			theSim.updateNeighbours(1);
 
-		theSim.placeParticlesIntoLinkedCellGrid(1);
-		comm.barrier();
-		if(comm.rank()==0) cout << "HERE 5.2" << endl;
+			if(!overlap) comm.barrier();
+			if(comm.rank()==0) cout << "HERE 5" << endl;
 
-		theSim.exchangeFull();
+			theSim.applyFunctions(physics::ResetVals<DIM>());	// set values to zero
+		}
 
 		if(comm.rank()==0) cout << "HERE 6" << endl;
 
 		// calculate sigma
 		theSim.doSPHSum<kernels::WendlandQuintic>(1,physics::SigmaCalc<DIM>());
-		theSim.exchangeData();
-
-		if(comm.rank()==0) cout << "HERE 7" << endl;
 
 		// calculate density then pressure
-		theSim.applyFunctions(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>());
+		if(overlap)
+		{
+			theSim.beginExchangeData(); // finished by the acceleration sum
+			theSim.applyFunctions(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>());
+		}
+		else if(fused)
+			theSim.exchangeData(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>()); // while the ghosts are exchanged
+		else
+		{
+			theSim.exchangeData();
+			if(comm.rank()==0) cout << "HERE 7" << endl;
+			theSim.applyFunctions(physics::DensityCalc<DIM>(),physics::TaitEquation<DIM>());
+		}
 
 		if(comm.rank()==0) cout << "HERE 8" << endl;
 
@@ -123,17 +192,45 @@ int run_main(int argc, char* argv[], boost::mpi::environment& env)
 
 		if(comm.rank()==0) cout << "HERE 9" << endl;
 
+		if(adaptive) theSim.beginTimestepReduction(1); // finished once the particles have moved
+
 		// move particles
 		theSim.applyFunctions(physics::PredictorCorrectorUpdater<1,DIM>());
 
+		if(adaptive) theSim.finishTimestepReduction();
+
 		if(comm.rank()==0) cout << "HERE 10" << endl;
 
-		theSim.exchangeOutOfBounds(0);
+		++step;
+		outputs.update(step,t+dt);
 
-		theSim.writeOutput(file_number);
-		++file_number;
+		if(t>4*dt) break;
+	}
+
+	theSim.finishOutput(); // any snapshots still being written in the background
 
-		if(t>4*discard_dims(theSim.parameters().dt)) break;
+	if(comm.rank()==0) cout << "Time stepping took " << step_timer.elapsed() << " s" << endl;
+
+	double output_time = 0.0;
+	boost::mpi::reduce(comm,theSim.outputTime(),output_time,boost::mpi::maximum<double>(),0);
+	if(comm.rank()==0) cout << "Held up by output for " << output_time << " s (slowest process)" << endl;
+
+	size_t total_cell_changes = 0;
+	boost::mpi::reduce(comm,cell_changes,total_cell_changes,std::plus<size_t>(),0);
+	if(comm.rank()==0) cout << "Cell changes: " << total_cell_changes << " over " << step-restart.step << " steps" << endl;
+
+	for(size_t i=0;i<outputs.streams();++i)
+	{
+		double stream_time = 0.0;
+		boost::mpi::reduce(comm,outputs.writeTime(i),stream_time,boost::mpi::maximum<double>(),0);
+		if(comm.rank()==0) cout << "Output " << outputs.name(i) << ": " << outputs.writes(i) << " written in " << stream_time << " s (slowest process)" << endl;
+	}
+
+	if(comm.rank()==0)
+	{
+		const TaskScheduler& sched = theSim.taskScheduler();
+		for(size_t t=0;t<sched.threads();++t)
+			cout << "Thread " << t << ": busy " << sched.busyTime()[t] << " s, idle " << sched.idleTime()[t] << " s" << endl;
 	}
 
 	if(comm.rank()==0) cout << "Finished." << endl;
@@ -144,7 +241,8 @@ int run_main(int argc, char* argv[], boost::mpi::environment& env)
 int main(int argc, char* argv[])
 {
 	// setup mpi
-	boost::mpi::environment env(argc,argv,true);
+	// only the main thread makes MPI calls, other threads are used within doSPHSum()
+	boost::mpi::environment env(argc,argv,boost::mpi::threading::funneled,true);
 	boost::mpi::communicator comm;
 
 	// run the program
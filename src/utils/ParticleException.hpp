@@ -16,8 +16,9 @@ public:
 
 
 protected:
-	const PType& _what;
+	const PType _what; // a copy, particles may be proxies into a ParticleStore
 	std::string msg;
+	mutable std::string full_msg; // keeps the string returned by what() alive
 };
 
 template<class PType>
@@ -48,7 +49,8 @@ const char* ParticleException<PType>::what() const noexcept
 
 	stringstream sstr;
 	sstr << msg << " due to " << _what;
-	return sstr.str().c_str();
+	full_msg = sstr.str();
+	return full_msg.c_str();
 }
 
 #endif /* PARTICLEEXCEPTION_HPP_ */
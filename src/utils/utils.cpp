@@ -1,4 +1,9 @@
 #include "utils.hpp"
+#include <limits>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -42,28 +47,212 @@ Subscript<3> idx_to_sub<3>(size_t idx, const nvect<3,size_t>& extent)
 	return out;
 }
 
+namespace
+{
+
+// cells in the largest domain and in the halo of one cell around it
+template<size_t Dim>
+void domain_cells(const nvect<Dim,size_t>& domains, const nvect<Dim,size_t>& cells, size_t& interior, size_t& halo)
+{
+	size_t outer = 1;
+	interior = 1;
+	for(size_t d=0;d<Dim;++d)
+	{
+		size_t n = (cells[d]+domains[d]-1)/domains[d];
+		interior *= n;
+		outer *= n+2;
+	}
+	halo = outer-interior;
+}
+
+// tries each way of splitting nproc between dimensions d onwards, keeping the
+// one with the smallest halo, the first found wins a tie
+template<size_t Dim>
+void find_domains(size_t nproc, const nvect<Dim,size_t>& cells, size_t d, nvect<Dim,size_t>& domains, nvect<Dim,size_t>& best, size_t& best_halo)
+{
+	for(size_t k=1;k<=nproc && k<=cells[d];++k)
+	{
+		if(nproc%k!=0 || (d==Dim-1 && k!=nproc))
+			continue;
+
+		domains[d] = k;
+		if(d<Dim-1)
+		{
+			find_domains<Dim>(nproc/k,cells,d+1,domains,best,best_halo);
+			continue;
+		}
+
+		size_t interior, halo;
+		domain_cells<Dim>(domains,cells,interior,halo);
+		if(halo<best_halo)
+		{
+			best = domains;
+			best_halo = halo;
+		}
+	}
+}
+
+/*
+ * Splits the cells between nproc processes so that the largest halo any of
+ * them has to exchange is as small as possible, so the shape of the domain is
+ * taken into account, e.g. a 4:1 channel on 16 processes is split 8x2.
+ */
+template<size_t Dim>
+nvect<Dim,size_t> domains_for(size_t nproc, const nvect<Dim,size_t>& cells)
+{
+	nvect<Dim,size_t> domains, best;
+	size_t best_halo = std::numeric_limits<size_t>::max();
+	find_domains<Dim>(nproc,cells,0,domains,best,best_halo);
+
+	if(best_halo==std::numeric_limits<size_t>::max())
+		throw runtime_error("Too many processes for the number of cells!");
+
+	return best;
+}
+
+template<size_t Dim>
+double ratio_for(const nvect<Dim,size_t>& domains, const nvect<Dim,size_t>& cells)
+{
+	size_t interior, halo;
+	domain_cells<Dim>(domains,cells,interior,halo);
+	return (double)halo/interior;
+}
+
+}
+
+template<>
+nvect<2,size_t> calc_num_domains<2>(size_t nproc, const nvect<2,size_t>& cells)
+{
+	return domains_for<2>(nproc,cells);
+}
+
 template<>
-nvect<2,size_t> calc_num_domains<2>(size_t nproc)
+nvect<3,size_t> calc_num_domains<3>(size_t nproc, const nvect<3,size_t>& cells)
+{
+	return domains_for<3>(nproc,cells);
+}
+
+/**
+ * The number of halo cells exchanged by the largest domain over the number of
+ * cells in it, for the given decomposition.
+ */
+template<>
+double halo_ratio<2>(const nvect<2,size_t>& domains, const nvect<2,size_t>& cells)
+{
+	return ratio_for<2>(domains,cells);
+}
+
+template<>
+double halo_ratio<3>(const nvect<3,size_t>& domains, const nvect<3,size_t>& cells)
+{
+	return ratio_for<3>(domains,cells);
+}
+
+/*
+ * Space filling curves
+ */
+
+namespace
+{
+
+// interleaves the bits of the coordinates, the first coordinate in the lowest bit
+size_t interleave(const unsigned* x, size_t dim, size_t bits)
+{
+	size_t idx = 0;
+	for(size_t b=bits;b-->0;)
+		for(size_t i=dim;i-->0;)
+			idx = (idx<<1) | ((x[i]>>b)&1);
+	return idx;
+}
+
+// Skilling's transform from coordinates to the "transposed" hilbert index, see
+// J. Skilling, Programming the Hilbert curve, AIP Conf. Proc. 707 (2004)
+void axes_to_transpose(unsigned* x, size_t dim, size_t bits)
+{
+	unsigned m = 1u << (bits-1);
+
+	// inverse undo
+	for(unsigned q=m;q>1;q>>=1)
+	{
+		unsigned p = q-1;
+		for(size_t i=0;i<dim;++i)
+		{
+			if(x[i] & q)
+				x[0] ^= p; // invert
+			else
+			{
+				unsigned t = (x[0]^x[i]) & p; // exchange
+				x[0] ^= t;
+				x[i] ^= t;
+			}
+		}
+	}
+
+	// gray encode
+	for(size_t i=1;i<dim;++i)
+		x[i] ^= x[i-1];
+
+	unsigned t = 0;
+	for(unsigned q=m;q>1;q>>=1)
+		if(x[dim-1] & q)
+			t ^= q-1;
+
+	for(size_t i=0;i<dim;++i)
+		x[i] ^= t;
+}
+
+template<size_t Dim>
+size_t morton(const Subscript<Dim>& sub, size_t bits)
+{
+	unsigned x[Dim];
+	for(size_t i=0;i<Dim;++i)
+		x[i] = sub[i];
+	return interleave(x,Dim,bits);
+}
+
+template<size_t Dim>
+size_t hilbert(const Subscript<Dim>& sub, size_t bits)
 {
-	size_t root = 1;
-	for(size_t i=2;i<=sqrt(nproc);++i)
-		if(nproc%i==0) root = i;
+	if(!bits) return 0;
+
+	// the transposed index holds the bits of the index spread over the
+	// coordinates, with the highest in the last coordinate
+	unsigned x[Dim];
+	for(size_t i=0;i<Dim;++i)
+		x[Dim-1-i] = sub[i];
+	axes_to_transpose(x,Dim,bits);
+
+	size_t idx = 0;
+	for(size_t b=bits;b-->0;)
+		for(size_t i=0;i<Dim;++i)
+			idx = (idx<<1) | ((x[i]>>b)&1);
+	return idx;
+}
 
-	return nvect<2,size_t>{root,nproc/root};
 }
 
 template<>
-nvect<3,size_t> calc_num_domains<3>(size_t nproc)
+size_t morton_index<2>(const Subscript<2>& sub, size_t bits)
 {
- 	size_t root1 = 1;
-	for(size_t i=2;i<=pow(nproc,1./3.);++i)
-		if(nproc%i==0) root1 = i;
+	return morton<2>(sub,bits);
+}
 
-	size_t root2 = 1;
-	for(size_t i=2;i<=sqrt(nproc/root1);++i)
-		if((nproc/root1)%i==0) root2 = i;
+template<>
+size_t morton_index<3>(const Subscript<3>& sub, size_t bits)
+{
+	return morton<3>(sub,bits);
+}
 
-	return nvect<3,size_t>{root1,root2,nproc/(root1*root2)};
+template<>
+size_t hilbert_index<2>(const Subscript<2>& sub, size_t bits)
+{
+	return hilbert<2>(sub,bits);
+}
+
+template<>
+size_t hilbert_index<3>(const Subscript<3>& sub, size_t bits)
+{
+	return hilbert<3>(sub,bits);
 }
 
 bool is_whitespace(char c)
@@ -80,6 +269,40 @@ string strip_whitespace(string s)
 	return out;
 }
 
+/**
+ * Computes root[i] = sqrt(x[i]) and inv_root[i] = 1/root[i] for n values, using
+ * AVX-512 or AVX2 when the compiler targets them. The vector instructions are
+ * correctly rounded so the results are the same as the scalar loop.
+ */
+void sqrt_and_reciprocal(const double* x, size_t n, double* root, double* inv_root)
+{
+	size_t i = 0;
+
+#if defined(__AVX512F__)
+	const __m512d one = _mm512_set1_pd(1.0);
+	for(;i+8<=n;i+=8)
+	{
+		__m512d r = _mm512_maskz_sqrt_pd(0xFF,_mm512_loadu_pd(x+i)); // zero masking, the unmasked form reads an undefined source
+		_mm512_storeu_pd(root+i,r);
+		_mm512_storeu_pd(inv_root+i,_mm512_div_pd(one,r));
+	}
+#elif defined(__AVX2__)
+	const __m256d one = _mm256_set1_pd(1.0);
+	for(;i+4<=n;i+=4)
+	{
+		__m256d r = _mm256_sqrt_pd(_mm256_loadu_pd(x+i));
+		_mm256_storeu_pd(root+i,r);
+		_mm256_storeu_pd(inv_root+i,_mm256_div_pd(one,r));
+	}
+#endif
+
+	for(;i<n;++i)
+	{
+		root[i] = std::sqrt(x[i]);
+		inv_root[i] = 1.0/root[i];
+	}
+}
+
 
 } /* namespace utils */
 } /* namespace sim */
@@ -68,7 +68,13 @@ template<size_t Dim> Subscript<Dim> idx_to_sub(size_t idx, const Extent<Dim>& ex
  * Decompose the domain
  */
 
-template<size_t Dim> nvect<Dim,size_t> calc_num_domains(size_t nproc);
+template<size_t Dim> nvect<Dim,size_t> calc_num_domains(size_t nproc, const Extent<Dim>& cells);
+template<size_t Dim> double halo_ratio(const Extent<Dim>& domains, const Extent<Dim>& cells);
+
+// position of a cell along a space filling curve through a grid of 2^bits cells
+// on each side, the cells must have non-negative subscripts
+template<size_t Dim> size_t morton_index(const Subscript<Dim>& sub, size_t bits);
+template<size_t Dim> size_t hilbert_index(const Subscript<Dim>& sub, size_t bits);
 
 /*
  * Various other functions
@@ -106,6 +112,16 @@ nvect<N,T> discard_dims(const nvect<N,quantity<Dim,T>>& v)
 	return out;
 }
 
+// Squared magnitude of an nvect<N,quantity<Dim,T>> as a raw value, which avoids
+// the square root in magnitude() when only comparing lengths
+template<size_t N, typename T, typename Dim>
+T square_magnitude(const nvect<N,quantity<Dim,T>>& v)
+{
+	T out = 0;
+	for(size_t i=0;i<N;++i)
+		out += discard_dims(v[i])*discard_dims(v[i]);
+	return out;
+}
 
 // Casts a general nvect<N,T> into one storing another type U.
 // Note: T must be castable to U.
@@ -133,6 +149,8 @@ nvect<N,U> qvect_cast(const nvect<N,quantity<Dim,T>>& v)
 bool is_whitespace(char c);
 std::string strip_whitespace(std::string s);
 
+void sqrt_and_reciprocal(const double* x, size_t n, double* root, double* inv_root);
+
 // only works if a > -b
 template<class T, class U>
 T mod(T a, U b)